@@ -1,77 +1,1638 @@
 /*Filename: count.c
   Created by: Aisha Iftikhar
   Creation date: 1/7/20
-  Synopsis: write a program in C called count to read a binary file and print the following statistics 
+  Synopsis: write a program in C called count to read a binary file and print the following statistics
             on the screen as well to an output file:
 		the size of the file in bytes
 		number of times the search string specified in the second argument appeared in the file
-	    run the program using count <input-filename> <search-string> <output-filename>
+	    run the program using count [-m] [-j threads] <input-filename> <search-string> <output-filename>
+	                       or count [-m] [-j threads] -f <pattern-file> <input-filename> <output-filename>
+	    an input filename of - reads standard input; pipes and other unseekable inputs are streamed
+	    -m maps the whole input into memory and searches the mapping directly (binary safe)
+	    -j splits the mapping into per-thread ranges that are counted in parallel
+	    -f counts every pattern in the pattern file (one per line) in a single Aho-Corasick pass
+	    a directory as input (or -l <file-list> in its place) counts every file with a pool of workers
+	    -e forces a search engine (simd, bmh or twoway); by default one is picked from the pattern
+	       length and byte statistics sampled from the start of the input
+	    -X builds a trigram index next to the input (<input-filename>.cidx); -x answers from it, scanning only
+	       the blocks that can hold a match, and falls back to a full scan when the index is stale
+	    -o varint|text writes the byte offset of every match to the output file, ahead of the usual lines
+	    the simd engine is a vectorized first/last byte filter (SSE2, AVX2 when the CPU has it)
 */
 
+/*nftw and madvise are XSI/BSD extensions*/
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+#include <ftw.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/*size of each read in the buffered scan*/
+#define READBUFFER (1 << 20)
+/*smallest range worth handing to its own thread in -j mode*/
+#define MINRANGE (1 << 20)
+#define MAXTHREADS 256
+/*number of byte values; one automaton transition per value*/
+#define ALPHABET 256
+/*bytes at the start of the input sampled to pick a search engine*/
+#define SAMPLESIZE (64 * 1024)
+
+/*sidecar index: every INDEXBLOCK bytes of input get a 2^SIGBITS bit signature of the trigrams
+  starting in them*/
+#define INDEXSUFFIX ".cidx"
+#define INDEXMAGIC "CIDX"
+#define INDEXVERSION 1
+#define INDEXBLOCK (1 << 20)
+#define SIGBITS 18
+#define SIGWORDS ((1 << SIGBITS) / 64)
+
+/*bytes of encoded offsets collected before each write to the output file*/
+#define OFFSETBUFFER (1 << 20)
+
+/*search engines*/
+#define ENGINE_AUTO 0
+#define ENGINE_SIMD 1		/*vectorized first/last byte prefilter*/
+#define ENGINE_BMH 2		/*Boyer-Moore-Horspool*/
+#define ENGINE_TWOWAY 3		/*Crochemore-Perrin Two-Way*/
+
+struct searcher;
+struct offset_writer;
+
+/*search kernel signature: count occurrences of the search string in buf*/
+typedef size_t (*count_fn)(const struct searcher *s, const char *buf, size_t len);
+
+/*a search string with everything each engine precomputes for it*/
+struct searcher {
+	const char *search;
+	size_t searchLen;
+	int engine;		/*ENGINE_AUTO until an engine is picked*/
+	count_fn kernel;	/*SIMD kernel picked for this CPU*/
+	size_t shift[ALPHABET];	/*BMH: shift for the byte under the last search position*/
+	size_t critPos;		/*Two-Way: critical factorization position*/
+	size_t period;		/*Two-Way: period of the search string*/
+	int periodic;		/*Two-Way: left half is repeated at period*/
+	struct offset_writer *offsets;	/*if set, every match offset is written here*/
+};
+
+/*buffered writer for match offsets (-o); engines report match pointers into the buffer being
+  searched, and bufBase/fileBase translate them back to file offsets*/
+struct offset_writer {
+	FILE *output;
+	int text;		/*decimal lines instead of delta varints*/
+	const char *bufBase;	/*buffer currently being searched*/
+	size_t fileBase;	/*file offset of bufBase[0]*/
+	size_t next;		/*previous offset + 1; deltas are taken against it so none is 0*/
+	size_t used;		/*bytes waiting in buf*/
+	unsigned char buf[OFFSETBUFFER];
+};
+
+/*Aho-Corasick automaton with a full transition table (failure links already folded in)*/
+struct ac_automaton {
+	int states;		/*number of states in use; state 0 is the root*/
+	int capacity;		/*number of states allocated*/
+	int *next;		/*next[state * ALPHABET + byte]*/
+	int *fail;		/*failure link of each state*/
+	int *order;		/*states in breadth-first order*/
+	int patterns;		/*number of patterns*/
+	char **pattern;		/*the patterns, in pattern file order*/
+	size_t *patternLen;
+	int *terminal;		/*state each pattern ends in*/
+	size_t maxLen;		/*longest pattern*/
+};
+
+/*structure used to hand one range of the mapping to a counting thread*/
+struct range_job {
+	const char *map;	/*start of the whole mapping*/
+	size_t size;		/*size of the whole mapping*/
+	size_t start, end;	/*matches starting in [start, end) belong to this range*/
+	const struct searcher *searcher;
+	size_t matches;		/*result*/
+	struct ac_automaton *ac;	/*set in multi-pattern mode instead of searcher*/
+	size_t *hits;		/*per-state hit counters for this range (multi-pattern mode)*/
+};
+
+/*result of counting one file in batch mode*/
+struct batch_result {
+	size_t size, matches;
+	size_t *counts;		/*per-pattern counts (multi-pattern mode)*/
+	int failed;		/*file could not be read*/
+};
+
+/*state shared by the batch worker pool*/
+struct batch_pool {
+	char **files;
+	int nfiles;
+	int next;		/*next file to hand out, taken with an atomic add*/
+	struct batch_result *results;	/*one per file, in list order*/
+	const struct searcher *searcher;	/*template; each worker picks engines on its own copy*/
+	struct ac_automaton *ac;
+	int useMmap;
+};
+
+/*header of the sidecar index file; the block signatures follow it*/
+struct index_header {
+	char magic[4];		/*INDEXMAGIC*/
+	uint32_t version;	/*INDEXVERSION*/
+	uint64_t fileSize;	/*size of the input when the index was built*/
+	int64_t mtimeSec;	/*modification time of the input when the index was built*/
+	int64_t mtimeNsec;
+	uint32_t blockSize;	/*INDEXBLOCK*/
+	uint32_t sigBits;	/*SIGBITS*/
+	uint64_t blocks;	/*number of block signatures*/
+};
+
+/*files collected for batch mode*/
+static char **batchFiles = NULL;
+static int batchCount = 0, batchCapacity = 0;
+
+/*Function Declarations*/
+size_t count_matches(const struct searcher *s, const char *buf, size_t len);
+#ifdef HAVE_X86_SIMD
+size_t count_sse2(const struct searcher *s, const char *buf, size_t len);
+size_t count_avx2(const struct searcher *s, const char *buf, size_t len);
+#endif
+void offset_emit(struct offset_writer *w, const char *match);
+void offset_flush(struct offset_writer *w);
+count_fn select_kernel(void);
+size_t count_bmh(const struct searcher *s, const char *buf, size_t len);
+size_t count_twoway(const struct searcher *s, const char *buf, size_t len);
+void searcher_init(struct searcher *s, const char *search, int engine);
+void searcher_select(struct searcher *s, const char *sample, size_t sampleLen);
+size_t searcher_count(const struct searcher *s, const char *buf, size_t len);
+int engine_by_name(const char *name);
+int count_file(const char *inFileName, struct searcher *searcher, struct ac_automaton *ac, size_t *hits, int useMmap, int threads, size_t *size, size_t *matchCount);
+void report(FILE *output, const char *title, size_t size, size_t matchCount, const struct ac_automaton *ac, const size_t *counts);
+int batch_add(const char *fileName);
+int batch_collect(const char *path, const struct stat *sb, int type, struct FTW *ftwbuf);
+int batch_dir(const char *dirName);
+int batch_list(const char *listFileName);
+int batch_compare(const void *a, const void *b);
+int count_batch(char **files, int nfiles, const struct searcher *searcher, struct ac_automaton *ac, int useMmap, int workers, FILE *output);
+void *batch_worker(void *arg);
+int map_input(const char *inFileName, char **map, size_t *size);
+uint32_t trigram_hash(const unsigned char *p);
+void index_name(const char *inFileName, char *name, size_t nameSize);
+int index_build(const char *inFileName);
+int index_query(const char *inFileName, struct searcher *searcher, size_t *size, size_t *matchCount);
+int scan_stream(int fd, struct searcher *searcher, struct ac_automaton *ac, size_t *hits, size_t *bytesSeen, size_t *matchCount);
+size_t count_parallel(const char *map, size_t size, const struct searcher *searcher, struct ac_automaton *ac, size_t *hits, int threads);
+void *count_range(void *arg);
+struct ac_automaton *ac_load(const char *patternFileName);
+int ac_add_state(struct ac_automaton *ac);
+void ac_build(struct ac_automaton *ac);
+int ac_scan(const struct ac_automaton *ac, const char *buf, size_t len, int state, size_t *hits);
+void ac_counts(const struct ac_automaton *ac, size_t *hits, size_t *counts);
+void usage(void);
 
 /*Main*/
 int main(int argc, char *argv[]){
 	/*variable declarations*/
-	FILE *input, *output;		/*input and output files*/
+	FILE *output;			/*output file*/
 	char *inFileName, *outFileName, *search;	/*input and output file names, and search string*/
-	int size, matchCount;		/*vars to store file size and count number of matches*/
-	const int MAXBUFFER = 100;	/*can only read file in chunks of 100 bytes or smaller*/
-	char arr[MAXBUFFER];		/*array to store input from file*/
+	char *patternFileName = NULL;	/*pattern file for multi-pattern mode*/
+	size_t size, matchCount = 0;	/*vars to store file size and count number of matches*/
+	struct stat st;			/*used to check whether the input is a directory*/
+	struct searcher searcher;	/*search string and the engine counting it*/
+	int engine = ENGINE_AUTO;	/*engine forced with -e*/
+	struct ac_automaton *ac = NULL;	/*automaton for multi-pattern mode*/
+	size_t *hits = NULL, *counts = NULL;	/*per-state hits and per-pattern counts (multi-pattern mode)*/
+	int opt, useMmap = 0;		/*command line option and mmap scan mode flag*/
+	int threads = 0;		/*number of counting threads or batch workers (0 = default)*/
+	char *listFileName = NULL;	/*file list for batch mode*/
+	int batch = 0, rc;		/*batch mode flag and return code*/
+	int useIndex = 0, buildIndex = 0;	/*answer from the sidecar index / (re)build it first*/
+	int answered = 0;		/*the index answered the query*/
+	char *offsetFormat = NULL;	/*varint or text: write every match offset (-o)*/
+	struct offset_writer *offsets = NULL;
+
+	/*Read options*/
+	while ((opt = getopt(argc, argv, "mj:f:e:l:xXo:")) != -1) {
+		switch (opt) {
+		case 'm':
+			useMmap = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > MAXTHREADS) {
+				printf("ERROR: Thread count must be between 1 and %d\n", MAXTHREADS);
+				exit(1);
+			}
+			break;
+		case 'l':
+			listFileName = optarg;
+			batch = 1;
+			break;
+		case 'X':
+			buildIndex = 1;
+			useIndex = 1;
+			break;
+		case 'x':
+			useIndex = 1;
+			break;
+		case 'o':
+			if (strcmp(optarg, "varint") != 0 && strcmp(optarg, "text") != 0) {
+				printf("ERROR: Unknown offset format %s\n", optarg);
+				usage();
+			}
+			offsetFormat = optarg;
+			break;
+		case 'f':
+			patternFileName = optarg;
+			break;
+		case 'e':
+			if ((engine = engine_by_name(optarg)) < 0) {
+				printf("ERROR: Unknown search engine %s\n", optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
 
-	/*Error check for correct input*/
-	if (argc != 4){
+	/*Error check for correct input; a pattern file takes the place of the search string
+	  and a file list takes the place of the input file*/
+	if (argc - optind != 3 - (patternFileName != NULL) - (listFileName != NULL)){
 		printf("ERROR: Incorrect number of arguments.\n");
-		printf("Use the format: count <inputfile> <searchstring> <outputfile> \n");
-		exit(1);
+		usage();
 	}
 
 	/*Assign input to variables*/
-	inFileName = argv[1];
-	search = argv[2];
-	outFileName = argv[3];
+	inFileName = (listFileName != NULL) ? NULL : argv[optind++];
+	search = (patternFileName != NULL) ? NULL : argv[optind++];
+	outFileName = argv[optind];
 
-	/*Error checking; opening input and output files*/
-	/*open input file*/
-	if ((input = fopen(inFileName, "rb")) == NULL) {
-		printf ("ERROR: Cannot open the input file %s\n", inFileName);
+	/*a directory as input means every regular file below it*/
+	if (inFileName != NULL && stat(inFileName, &st) == 0 && S_ISDIR(st.st_mode)) {
+		batch = 1;
+	}
+	/*offsets are written in file order by a single scan of a single file with a single search string*/
+	if (offsetFormat != NULL && (batch || patternFileName != NULL)) {
+		printf("ERROR: -o needs a single input file and a single search string.\n");
 		exit(1);
 	}
+	/*each file has its own index; batch mode scans, so refuse rather than quietly ignore -x/-X*/
+	if (useIndex && batch) {
+		printf("ERROR: -x and -X need a single input file.\n");
+		exit(1);
+	}
+	if (offsetFormat != NULL) {
+		threads = 1;
+	}
+	/*-j splits a single file across threads on the mapping; in batch mode it sizes the worker pool*/
+	if (!batch && threads > 1) {
+		useMmap = 1;
+	}
+
+	if (patternFileName != NULL) {
+		/*build the automaton once; every pattern is then counted in the same pass*/
+		if ((ac = ac_load(patternFileName)) == NULL) {
+			exit(1);
+		}
+		hits = calloc(ac->states, sizeof(size_t));
+		counts = calloc(ac->patterns, sizeof(size_t));
+		if (hits == NULL || counts == NULL) {
+			printf("ERROR: Out of memory\n");
+			exit(1);
+		}
+	} else if (search[0] == '\0') {
+		/*You cannot search for the empty string*/
+		printf("ERROR: Cannot search for the empty string.\n");
+		exit(1);
+	} else {
+		searcher_init(&searcher, search, engine);
+	}
+
 	/*open output file*/
 	if ((output = fopen(outFileName, "wb")) == NULL) {
 		printf ("ERROR: Cannot open the output file %s\n", outFileName);
 		exit(1);
 	}
 
-	/*Calculate file size*/
-	fseek(input, 0, SEEK_END);
-	size = ftell(input);
-	fseek(input, 0, SEEK_SET);
-	
+	if (batch) {
+		/*many files: one line group per file plus a total, counted by a pool of workers*/
+		if (listFileName != NULL) {
+			rc = batch_list(listFileName);
+		} else {
+			rc = batch_dir(inFileName);
+		}
+		if (rc != 0) {
+			exit(1);
+		}
+		if (threads == 0) {
+			threads = sysconf(_SC_NPROCESSORS_ONLN);
+			threads = (threads < 1) ? 1 : (threads > MAXTHREADS ? MAXTHREADS : threads);
+		}
+		rc = count_batch(batchFiles, batchCount, ac == NULL ? &searcher : NULL, ac, useMmap, threads, output);
+		fclose(output);
+		return rc;
+	}
+
+	/*offsets go in front of the usual lines, which are only known once the scan ends*/
+	if (offsetFormat != NULL) {
+		if ((offsets = calloc(1, sizeof(*offsets))) == NULL) {
+			printf("ERROR: Out of memory\n");
+			exit(1);
+		}
+		offsets->output = output;
+		offsets->text = (strcmp(offsetFormat, "text") == 0);
+		fprintf(output, "Offsets (%s):\n", offsetFormat);
+		searcher.offsets = offsets;
+	}
+
+	/*the index answers single-string queries on files; anything else is an ordinary scan, and
+	  -X builds nothing since standard input has no file to index and this query would not use it*/
+	if (useIndex && (ac != NULL || strcmp(inFileName, "-") == 0)) {
+		printf("The index only answers single search strings on files; scanning instead.\n");
+		useIndex = 0;
+		buildIndex = 0;
+	}
+	if (buildIndex && index_build(inFileName) != 0) {
+		exit(1);
+	}
+	if (useIndex) {
+		rc = index_query(inFileName, &searcher, &size, &matchCount);
+		if (rc < 0) {
+			exit(1);
+		}
+		if (rc == 0) {
+			answered = 1;
+		} else {
+			printf("Index for %s is missing or stale; scanning instead.\n", inFileName);
+		}
+	}
+
+	/*size is the number of bytes seen for streamed input, so results are printed once counting ends*/
+	if (!answered && count_file(inFileName, ac == NULL ? &searcher : NULL, ac, hits, useMmap, threads, &size, &matchCount) != 0) {
+		exit(1);
+	}
+	if (ac != NULL) {
+		ac_counts(ac, hits, counts);
+	}
+	if (offsets != NULL) {
+		/*a zero delta never occurs, so it ends the varint stream*/
+		if (!offsets->text) {
+			offsets->buf[offsets->used++] = 0;
+		}
+		offset_flush(offsets);
+		free(offsets);
+	}
+	report(output, NULL, size, matchCount, ac, counts);
+
+	/*Close files*/
+	fclose(output);
+
+return 0;
+}
+
+
+/*count_matches counts every (possibly overlapping) occurrence of search in buf; NUL bytes are ordinary data*/
+size_t count_matches(const struct searcher *s, const char *buf, size_t len) {
+	const char *search = s->search;
+	size_t matches = 0, searchLen = s->searchLen;
+	const char *p = buf, *end;
+
+	if (searchLen == 0 || len < searchLen) {
+		return 0;
+	}
+	/*last position a match can start at*/
+	end = buf + len - searchLen;
+
+	/*jump between candidate first bytes with memchr, then compare the rest*/
+	while (p <= end && (p = memchr(p, search[0], end - p + 1)) != NULL) {
+		if (memcmp(p + 1, search + 1, searchLen - 1) == 0) {
+			matches++;
+			if (s->offsets != NULL) {
+				offset_emit(s->offsets, p);
+			}
+		}
+		++p;
+	}
+	return matches;
+}
+
+
+#ifdef HAVE_X86_SIMD
+/*count_sse2 compares 16 candidate positions at a time against the first and last byte of search;
+  only positions where both agree are verified with memcmp*/
+size_t count_sse2(const struct searcher *s, const char *buf, size_t len) {
+	const char *search = s->search;
+	size_t matches = 0, i = 0, last, searchLen = s->searchLen;
+	__m128i first, lastByte, blockFirst, blockLast;
+	unsigned int mask;
+	int bit;
+
+	if (searchLen == 0 || len < searchLen) {
+		return 0;
+	}
+	last = len - searchLen;	/*last position a match can start at*/
+	first = _mm_set1_epi8(search[0]);
+	lastByte = _mm_set1_epi8(search[searchLen - 1]);
+
+	for (; i + 16 <= last + 1; i += 16) {
+		blockFirst = _mm_loadu_si128((const __m128i *)(buf + i));
+		blockLast = _mm_loadu_si128((const __m128i *)(buf + i + searchLen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst),
+		                                       _mm_cmpeq_epi8(lastByte, blockLast)));
+		while (mask != 0) {
+			bit = __builtin_ctz(mask);
+			if (searchLen <= 2 || memcmp(buf + i + bit + 1, search + 1, searchLen - 2) == 0) {
+				matches++;
+				if (s->offsets != NULL) {
+					offset_emit(s->offsets, buf + i + bit);
+				}
+			}
+			mask &= mask - 1;
+		}
+	}
+	/*fewer than 16 candidate positions left*/
+	return matches + count_matches(s, buf + i, len - i);
+}
+
+
+/*count_avx2 is count_sse2 with 32 candidate positions per step*/
+__attribute__((target("avx2")))
+size_t count_avx2(const struct searcher *s, const char *buf, size_t len) {
+	const char *search = s->search;
+	size_t matches = 0, i = 0, last, searchLen = s->searchLen;
+	__m256i first, lastByte, blockFirst, blockLast;
+	unsigned int mask;
+	int bit;
+
+	if (searchLen == 0 || len < searchLen) {
+		return 0;
+	}
+	last = len - searchLen;	/*last position a match can start at*/
+	first = _mm256_set1_epi8(search[0]);
+	lastByte = _mm256_set1_epi8(search[searchLen - 1]);
+
+	for (; i + 32 <= last + 1; i += 32) {
+		blockFirst = _mm256_loadu_si256((const __m256i *)(buf + i));
+		blockLast = _mm256_loadu_si256((const __m256i *)(buf + i + searchLen - 1));
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst),
+		                                                           _mm256_cmpeq_epi8(lastByte, blockLast)));
+		while (mask != 0) {
+			bit = __builtin_ctz(mask);
+			if (searchLen <= 2 || memcmp(buf + i + bit + 1, search + 1, searchLen - 2) == 0) {
+				matches++;
+				if (s->offsets != NULL) {
+					offset_emit(s->offsets, buf + i + bit);
+				}
+			}
+			mask &= mask - 1;
+		}
+	}
+	/*fewer than 32 candidate positions left*/
+	return matches + count_sse2(s, buf + i, len - i);
+}
+#endif
+
+
+/*select_kernel picks the widest search kernel the running CPU supports*/
+count_fn select_kernel(void) {
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return count_avx2;
+	}
+	return count_sse2;
+#else
+	return count_matches;
+#endif
+}
+
+
+
+
+/*offset_emit records the file offset of a match starting at match: as the difference from the
+  previous offset in LEB128 varint form (7 bits per byte, high bit set on all but the last byte),
+  or as a decimal line in text mode*/
+void offset_emit(struct offset_writer *w, const char *match) {
+	size_t offset = w->fileBase + (size_t)(match - w->bufBase), delta;
+	unsigned char *out, digits[24];
+	int n = 0;
+
+	/*room for the longest encoding (20 digits and a newline)*/
+	if (w->used > OFFSETBUFFER - 24) {
+		offset_flush(w);
+	}
+	out = w->buf + w->used;
+
+	if (w->text) {
+		do {
+			digits[n++] = '0' + offset % 10;
+			offset /= 10;
+		} while (offset != 0);
+		while (n > 0) {
+			*out++ = digits[--n];
+		}
+		*out++ = '\n';
+	} else {
+		delta = offset + 1 - w->next;
+		w->next = offset + 1;
+		while (delta >= 0x80) {
+			*out++ = (delta & 0x7f) | 0x80;
+			delta >>= 7;
+		}
+		*out++ = delta;
+	}
+	w->used = out - w->buf;
+}
+
+
+/*offset_flush writes the collected offsets to the output file*/
+void offset_flush(struct offset_writer *w) {
+	if (w->used > 0 && fwrite(w->buf, 1, w->used, w->output) != w->used) {
+		perror("ERROR: Cannot write the offsets");
+		exit(1);
+	}
+	w->used = 0;
+}
+
+
+/*count_bmh is Boyer-Moore-Horspool: the byte under the last search position decides how far to
+  shift, so long search strings skip most of the input without looking at it*/
+size_t count_bmh(const struct searcher *s, const char *buf, size_t len) {
+	const unsigned char *hay = (const unsigned char *)buf;
+	size_t matches = 0, j = 0, m = s->searchLen;
+	unsigned char last = s->search[m - 1], c;
+
+	if (len < m) {
+		return 0;
+	}
+	while (j <= len - m) {
+		c = hay[j + m - 1];
+		if (c == last && memcmp(hay + j, s->search, m - 1) == 0) {
+			matches++;
+			if (s->offsets != NULL) {
+				offset_emit(s->offsets, buf + j);
+			}
+		}
+		j += s->shift[c];
+	}
+	return matches;
+}
+
+
+/*count_twoway is the Crochemore-Perrin Two-Way algorithm: the search string is split at its critical
+  position, the right half is compared left to right and the left half right to left. It never
+  backtracks in the input, so low-entropy data can't drive it quadratic the way it can BMH*/
+size_t count_twoway(const struct searcher *s, const char *buf, size_t len) {
+	const unsigned char *hay = (const unsigned char *)buf;
+	const unsigned char *needle = (const unsigned char *)s->search;
+	size_t matches = 0, j = 0, i, memory = 0, shift, m = s->searchLen, crit = s->critPos;
+
+	if (len < m) {
+		return 0;
+	}
+
+	if (s->periodic) {
+		/*memory remembers how much of the left half is known to match after a periodic shift*/
+		while (j <= len - m) {
+			i = (crit > memory) ? crit : memory;
+			while (i < m && needle[i] == hay[i + j]) {
+				++i;
+			}
+			if (i < m) {
+				j += i - crit + 1;
+				memory = 0;
+				continue;
+			}
+			i = crit;
+			while (i > memory && needle[i - 1] == hay[i - 1 + j]) {
+				--i;
+			}
+			if (i <= memory) {
+				matches++;
+				if (s->offsets != NULL) {
+					offset_emit(s->offsets, buf + j);
+				}
+			}
+			/*occurrences of a periodic string are at least one period apart*/
+			j += s->period;
+			memory = m - s->period;
+		}
+	} else {
+		/*the halves share no period, so any two occurrences are further apart than the longer half*/
+		shift = ((crit > m - crit) ? crit : m - crit) + 1;
+		while (j <= len - m) {
+			i = crit;
+			while (i < m && needle[i] == hay[i + j]) {
+				++i;
+			}
+			if (i < m) {
+				j += i - crit + 1;
+				continue;
+			}
+			i = crit;
+			while (i > 0 && needle[i - 1] == hay[i - 1 + j]) {
+				--i;
+			}
+			if (i == 0) {
+				matches++;
+				if (s->offsets != NULL) {
+					offset_emit(s->offsets, buf + j);
+				}
+			}
+			j += shift;
+		}
+	}
+	return matches;
+}
+
+
+/*searcher_init precomputes the BMH shift table and the Two-Way critical factorization for search*/
+void searcher_init(struct searcher *s, const char *search, int engine) {
+	const unsigned char *needle = (const unsigned char *)search;
+	size_t m = strlen(search), i, j, k, p, maxSuffix, maxSuffixRev, periodRev;
+	int pass;
+
+	s->search = search;
+	s->searchLen = m;
+	s->engine = engine;
+	s->kernel = select_kernel();
+	s->offsets = NULL;
+
+	/*BMH: distance from the last occurrence of each byte (excluding the last position) to the end*/
+	for (i = 0; i < ALPHABET; i++) {
+		s->shift[i] = m;
+	}
+	for (i = 0; i + 1 < m; i++) {
+		s->shift[needle[i]] = m - 1 - i;
+	}
+
+	/*Two-Way: the critical position is the later of the maximal suffixes under the two byte orders*/
+	maxSuffix = maxSuffixRev = 0;
+	s->period = periodRev = 1;
+	for (pass = 0; pass < 2; pass++) {
+		size_t ms = (size_t)-1;		/*wraps to 0 when k is added*/
+		j = 0;
+		k = p = 1;
+		while (j + k < m) {
+			unsigned char a = needle[j + k], b = needle[ms + k];
+			if (pass == 0 ? a < b : a > b) {
+				j += k;
+				k = 1;
+				p = j - ms;
+			} else if (a == b) {
+				if (k != p) {
+					++k;
+				} else {
+					j += p;
+					k = 1;
+				}
+			} else {
+				ms = j++;
+				k = p = 1;
+			}
+		}
+		if (pass == 0) {
+			maxSuffix = ms + 1;
+			s->period = p;
+		} else {
+			maxSuffixRev = ms + 1;
+			periodRev = p;
+		}
+	}
+	if (maxSuffixRev > maxSuffix) {
+		s->critPos = maxSuffixRev;
+		s->period = periodRev;
+	} else {
+		s->critPos = maxSuffix;
+	}
+	s->periodic = (s->critPos + s->period <= m && memcmp(needle, needle + s->period, s->critPos) == 0);
+}
+
+
+/*searcher_select picks an engine from the search string and a sample of the input, unless one was
+  forced. The SIMD filter wins whenever its first/last byte test rarely fires on the sample; when it
+  fires often, long search strings over a varied alphabet get BMH (long skips) and everything
+  else gets Two-Way (linear time on repetitive data)*/
+void searcher_select(struct searcher *s, const char *sample, size_t sampleLen) {
+	const unsigned char *p = (const unsigned char *)sample;
+	unsigned char first = s->search[0], last = s->search[s->searchLen - 1];
+	size_t i, candidates = 0, positions, distinct = 0;
+	char seen[ALPHABET];
+
+	if (s->engine != ENGINE_AUTO) {
+		return;
+	}
+	/*single bytes and tiny samples gain nothing from the other engines*/
+	if (s->searchLen == 1 || sampleLen < s->searchLen) {
+		s->engine = ENGINE_SIMD;
+		return;
+	}
+
+	memset(seen, 0, sizeof(seen));
+	positions = sampleLen - s->searchLen + 1;
+	for (i = 0; i < positions; i++) {
+		candidates += (p[i] == first && p[i + s->searchLen - 1] == last);
+	}
+	for (i = 0; i < sampleLen; i++) {
+		if (!seen[p[i]]) {
+			seen[p[i]] = 1;
+			distinct++;
+		}
+	}
+
+	if (candidates * 64 < positions) {
+		s->engine = ENGINE_SIMD;
+	} else if (s->searchLen >= 16 && distinct >= 16) {
+		s->engine = ENGINE_BMH;
+	} else {
+		s->engine = ENGINE_TWOWAY;
+	}
+}
+
+
+/*searcher_count counts occurrences of the search string in buf with the selected engine*/
+size_t searcher_count(const struct searcher *s, const char *buf, size_t len) {
+	switch (s->engine) {
+	case ENGINE_BMH:
+		return count_bmh(s, buf, len);
+	case ENGINE_TWOWAY:
+		return count_twoway(s, buf, len);
+	default:
+		return s->kernel(s, buf, len);
+	}
+}
+
+
+/*engine_by_name maps a -e argument to an engine, or -1 if there is no such engine*/
+int engine_by_name(const char *name) {
+	if (strcmp(name, "auto") == 0) {
+		return ENGINE_AUTO;
+	} else if (strcmp(name, "simd") == 0) {
+		return ENGINE_SIMD;
+	} else if (strcmp(name, "bmh") == 0) {
+		return ENGINE_BMH;
+	} else if (strcmp(name, "twoway") == 0) {
+		return ENGINE_TWOWAY;
+	}
+	return -1;
+}
+
+
+/*count_file counts one input (a file, or "-" for standard input) into *size and *matchCount,
+  or into hits in multi-pattern mode; searcher is NULL in multi-pattern mode*/
+int count_file(const char *inFileName, struct searcher *searcher, struct ac_automaton *ac, size_t *hits, int useMmap, int threads, size_t *size, size_t *matchCount) {
+	struct stat st;
+	char *map = NULL;
+	int fd, rc;
+
+	*matchCount = 0;
+
+	/*only regular files can be mapped; stdin and pipes are streamed instead*/
+	if (useMmap && (strcmp(inFileName, "-") == 0 || (stat(inFileName, &st) == 0 && !S_ISREG(st.st_mode)))) {
+		useMmap = 0;
+	}
+
+	if (useMmap) {
+		/*search the whole mapping at once; matches across chunks and NUL bytes are counted*/
+		if (map_input(inFileName, &map, size) != 0) {
+			return -1;
+		}
+
+		if (ac == NULL) {
+			searcher_select(searcher, map, *size < SAMPLESIZE ? *size : SAMPLESIZE);
+			if (searcher->offsets != NULL) {
+				searcher->offsets->bufBase = map;
+				searcher->offsets->fileBase = 0;
+			}
+		}
+		if (threads > 1) {
+			*matchCount = count_parallel(map, *size, searcher, ac, hits, threads);
+		} else if (ac != NULL) {
+			ac_scan(ac, map, *size, 0, hits);
+		} else {
+			*matchCount = searcher_count(searcher, map, *size);
+		}
+
+		if (map != NULL) {
+			munmap(map, *size);
+		}
+		return 0;
+	}
+
+	/*"-" reads standard input; anything else is opened as a plain descriptor, so pipes,
+	  FIFOs and character devices work too*/
+	if (strcmp(inFileName, "-") == 0) {
+		fd = STDIN_FILENO;
+	} else if ((fd = open(inFileName, O_RDONLY)) < 0) {
+		printf ("ERROR: Cannot open the input file %s\n", inFileName);
+		return -1;
+	}
+
+	rc = scan_stream(fd, searcher, ac, hits, size, matchCount);
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	return rc;
+}
+
+
+/*report prints the size and match lines to the console and the output file; title (if any) names
+  the file the lines belong to in batch mode*/
+void report(FILE *output, const char *title, size_t size, size_t matchCount, const struct ac_automaton *ac, const size_t *counts) {
+	int i;
+
+	if (title != NULL) {
+		printf("%s\n", title);
+		fprintf(output, "\n%s", title);
+	}
+
 	/*print statement size of file to console*/
 	printf("Size of file: %zu\n", size);
 	/*print to output file*/
 	fprintf(output, "\nSize of file: %zu\n", size);
 
-	/*count number of matches*/
-	while (fgets (arr, MAXBUFFER, input) != NULL) {
-		char *match = arr;
-		while ((match = (strstr(match, search))) != NULL) {
-			matchCount++;
-			++match;
+	if (ac != NULL) {
+		/*one line per pattern, then the total over all patterns*/
+		matchCount = 0;
+		for (i = 0; i < ac->patterns; i++) {
+			printf("Number of matches for %s: %zu\n", ac->pattern[i], counts[i]);
+			fprintf(output, "Number of matches for %s: %zu\n", ac->pattern[i], counts[i]);
+			matchCount += counts[i];
 		}
 	}
 
 	/*print statement number of matches*/
-	printf("Number of matches: %d\n", matchCount);
+	printf("Number of matches: %zu\n", matchCount);
 	/*print to output file*/
-	fprintf(output, "Number of matches: %d\n", matchCount);
+	fprintf(output, "Number of matches: %zu\n", matchCount);
+}
 
-	/*Close files*/
-	fclose(input);
-	fclose(output);
 
-return 0;
+/*batch_add appends a copy of fileName to the batch file list*/
+int batch_add(const char *fileName) {
+	if (batchCount == batchCapacity) {
+		batchCapacity = batchCapacity ? batchCapacity * 2 : 1024;
+		if ((batchFiles = realloc(batchFiles, batchCapacity * sizeof(char *))) == NULL) {
+			printf("ERROR: Out of memory\n");
+			return -1;
+		}
+	}
+	if ((batchFiles[batchCount] = strdup(fileName)) == NULL) {
+		printf("ERROR: Out of memory\n");
+		return -1;
+	}
+	batchCount++;
+	return 0;
+}
+
+
+/*batch_collect is the nftw callback adding every regular file to the batch*/
+int batch_collect(const char *path, const struct stat *sb, int type, struct FTW *ftwbuf) {
+	if (type == FTW_F && S_ISREG(sb->st_mode)) {
+		return batch_add(path);
+	}
+	return 0;
+}
+
+
+/*batch_dir collects every regular file below dirName, in name order*/
+int batch_dir(const char *dirName) {
+	if (nftw(dirName, batch_collect, 64, FTW_PHYS) != 0) {
+		printf("ERROR: Cannot read the directory %s\n", dirName);
+		return -1;
+	}
+	qsort(batchFiles, batchCount, sizeof(char *), batch_compare);
+	return 0;
+}
+
+
+/*batch_list reads one file name per line from listFileName ("-" for standard input), in list order*/
+int batch_list(const char *listFileName) {
+	FILE *list;
+	char *line = NULL;
+	size_t lineCap = 0;
+	ssize_t len;
+
+	if (strcmp(listFileName, "-") == 0) {
+		list = stdin;
+	} else if ((list = fopen(listFileName, "r")) == NULL) {
+		printf ("ERROR: Cannot open the file list %s\n", listFileName);
+		return -1;
+	}
+	while ((len = getline(&line, &lineCap, list)) != -1) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		if (len > 0 && batch_add(line) != 0) {
+			return -1;
+		}
+	}
+	free(line);
+	if (list != stdin) {
+		fclose(list);
+	}
+	return 0;
+}
+
+
+/*batch_compare orders file names for qsort*/
+int batch_compare(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/*count_batch counts every file with a fixed pool of workers, then reports each file in list order
+  followed by the totals; returns 1 if any file could not be read*/
+int count_batch(char **files, int nfiles, const struct searcher *searcher, struct ac_automaton *ac, int useMmap, int workers, FILE *output) {
+	struct batch_pool pool;
+	pthread_t tids[MAXTHREADS];
+	size_t totalSize = 0, totalMatches = 0, *totalCounts = NULL;
+	char title[64];
+	int i, p, started = 0, failed = 0;
+
+	pool.files = files;
+	pool.nfiles = nfiles;
+	pool.next = 0;
+	pool.searcher = searcher;
+	pool.ac = ac;
+	pool.useMmap = useMmap;
+	if ((pool.results = calloc(nfiles > 0 ? nfiles : 1, sizeof(struct batch_result))) == NULL) {
+		printf("ERROR: Out of memory\n");
+		return 1;
+	}
+	if (ac != NULL && (totalCounts = calloc(ac->patterns, sizeof(size_t))) == NULL) {
+		printf("ERROR: Out of memory\n");
+		return 1;
+	}
+
+	/*no more workers than files; this thread is one of them*/
+	if (workers > nfiles) {
+		workers = (nfiles > 0) ? nfiles : 1;
+	}
+	for (i = 1; i < workers; i++) {
+		if (pthread_create(&tids[i], NULL, batch_worker, &pool) != 0) {
+			break;
+		}
+		started = i;
+	}
+	batch_worker(&pool);
+	for (i = 1; i <= started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		if (pool.results[i].failed) {
+			printf("File: %s\nERROR: Cannot read the file\n", files[i]);
+			fprintf(output, "\nFile: %s\nERROR: Cannot read the file\n", files[i]);
+			failed = 1;
+			continue;
+		}
+		printf("File: %s\n", files[i]);
+		fprintf(output, "\nFile: %s", files[i]);
+		report(output, NULL, pool.results[i].size, pool.results[i].matches, ac, pool.results[i].counts);
+		totalSize += pool.results[i].size;
+		totalMatches += pool.results[i].matches;
+		if (ac != NULL) {
+			for (p = 0; p < ac->patterns; p++) {
+				totalCounts[p] += pool.results[i].counts[p];
+			}
+			free(pool.results[i].counts);
+		}
+	}
+
+	snprintf(title, sizeof(title), "Total (%d files)", nfiles);
+	report(output, title, totalSize, totalMatches, ac, totalCounts);
+
+	free(totalCounts);
+	free(pool.results);
+	return failed;
+}
+
+
+/*batch_worker takes files off the shared list until none are left; each worker has its own copy of
+  the searcher (engine selection is per file) and its own automaton hit counters*/
+void *batch_worker(void *arg) {
+	struct batch_pool *pool = arg;
+	struct searcher searcher;
+	struct batch_result *result;
+	size_t *hits = NULL;
+	int i;
+
+	if (pool->ac != NULL && (hits = malloc(pool->ac->states * sizeof(size_t))) == NULL) {
+		printf("ERROR: Out of memory\n");
+		exit(1);
+	}
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->nfiles) {
+		result = &pool->results[i];
+		if (pool->ac != NULL) {
+			memset(hits, 0, pool->ac->states * sizeof(size_t));
+		} else {
+			searcher = *pool->searcher;
+		}
+
+		if (count_file(pool->files[i], pool->ac == NULL ? &searcher : NULL, pool->ac, hits, pool->useMmap, 1, &result->size, &result->matches) != 0) {
+			result->failed = 1;
+			continue;
+		}
+		if (pool->ac != NULL) {
+			if ((result->counts = malloc(pool->ac->patterns * sizeof(size_t))) == NULL) {
+				printf("ERROR: Out of memory\n");
+				exit(1);
+			}
+			ac_counts(pool->ac, hits, result->counts);
+		}
+	}
+
+	free(hits);
+	return NULL;
+}
+
+
+/*scan_stream counts matches in everything read from fd until end of file, using one fixed buffer:
+  only the last searchLen-1 bytes of each read are carried in front of the next one, so memory use
+  does not depend on the input size and the input never has to be seekable*/
+int scan_stream(int fd, struct searcher *searcher, struct ac_automaton *ac, size_t *hits, size_t *bytesSeen, size_t *matchCount) {
+	size_t searchLen = (searcher != NULL) ? searcher->searchLen : 0;
+	size_t carry = 0, n;
+	ssize_t rc;
+	char *arr;
+	int state = 0;
+
+	*bytesSeen = 0;
+	if ((arr = malloc(READBUFFER + searchLen)) == NULL) {
+		printf("ERROR: Out of memory\n");
+		return -1;
+	}
+
+	while (1) {
+		/*fill the rest of the buffer; pipes hand out data in small pieces*/
+		n = 0;
+		while (n < READBUFFER) {
+			rc = read(fd, arr + carry + n, READBUFFER - n);
+			if (rc < 0 && errno == EINTR) {
+				continue;
+			}
+			if (rc < 0) {
+				perror("ERROR: read failed");
+				free(arr);
+				return -1;
+			}
+			if (rc == 0) {
+				break;
+			}
+			n += rc;
+		}
+		if (n == 0) {
+			break;
+		}
+		*bytesSeen += n;
+
+		if (ac != NULL) {
+			/*the automaton state carries over from one read to the next, so nothing is re-read*/
+			state = ac_scan(ac, arr, n, state, hits);
+			continue;
+		}
+
+		/*the first block read is the sample the engine is picked from*/
+		if (*bytesSeen == n) {
+			searcher_select(searcher, arr, n < SAMPLESIZE ? n : SAMPLESIZE);
+		}
+
+		/*the carried bytes can't hold a whole match by themselves, so nothing is counted twice*/
+		n += carry;
+		if (searcher->offsets != NULL) {
+			searcher->offsets->bufBase = arr;
+			searcher->offsets->fileBase = *bytesSeen - n;
+		}
+		*matchCount += searcher_count(searcher, arr, n);
+		carry = (n < searchLen - 1) ? n : searchLen - 1;
+		memmove(arr, arr + n - carry, carry);
+	}
+
+	free(arr);
+	return 0;
+}
+
+
+/*trigram_hash maps the three bytes at p to one of the 2^SIGBITS signature bits*/
+uint32_t trigram_hash(const unsigned char *p) {
+	uint32_t trigram = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+	return (trigram * 2654435761u) >> (32 - SIGBITS);
+}
+
+
+/*index_name builds the sidecar index file name for inFileName*/
+void index_name(const char *inFileName, char *name, size_t nameSize) {
+	snprintf(name, nameSize, "%s%s", inFileName, INDEXSUFFIX);
+}
+
+
+/*index_build writes the sidecar index for inFileName: a header recording the size and modification
+  time of the input, then one trigram signature per block. It is written to a temporary file and
+  renamed into place so a reader never sees half an index; on any failure the temporary file is
+  removed and the old index, if any, is left alone*/
+int index_build(const char *inFileName) {
+	struct index_header header;
+	struct stat st;
+	char name[4096], tmpName[4096 + 8];
+	const unsigned char *data;
+	char *map;
+	uint64_t *sig;
+	size_t size, b, p, end, last;
+	uint32_t h;
+	FILE *index;
+	int ok;
+
+	if (stat(inFileName, &st) != 0) {
+		printf ("ERROR: Cannot open the input file %s\n", inFileName);
+		return -1;
+	}
+	if (map_input(inFileName, &map, &size) != 0) {
+		return -1;
+	}
+	data = (const unsigned char *)map;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEXMAGIC, 4);
+	header.version = INDEXVERSION;
+	header.fileSize = size;
+	header.mtimeSec = st.st_mtim.tv_sec;
+	header.mtimeNsec = st.st_mtim.tv_nsec;
+	header.blockSize = INDEXBLOCK;
+	header.sigBits = SIGBITS;
+	header.blocks = (size + INDEXBLOCK - 1) / INDEXBLOCK;
+
+	/*one signature at a time; a trigram belongs to the block it starts in*/
+	if ((sig = malloc(SIGWORDS * sizeof(uint64_t))) == NULL) {
+		printf("ERROR: Out of memory\n");
+		if (map != NULL) {
+			munmap(map, size);
+		}
+		return -1;
+	}
+	index_name(inFileName, name, sizeof(name));
+	snprintf(tmpName, sizeof(tmpName), "%s.tmp", name);
+	if ((index = fopen(tmpName, "wb")) == NULL) {
+		printf ("ERROR: Cannot create the index file %s\n", tmpName);
+		free(sig);
+		if (map != NULL) {
+			munmap(map, size);
+		}
+		return -1;
+	}
+	ok = (fwrite(&header, sizeof(header), 1, index) == 1);
+
+	for (b = 0; ok && b < header.blocks; b++) {
+		memset(sig, 0, SIGWORDS * sizeof(uint64_t));
+		end = (b + 1) * INDEXBLOCK;
+		last = (size >= 3) ? size - 2 : 0;	/*trigrams start before the last two bytes*/
+		if (end > last) {
+			end = last;
+		}
+		for (p = b * INDEXBLOCK; p < end; p++) {
+			h = trigram_hash(data + p);
+			sig[h / 64] |= (uint64_t)1 << (h % 64);
+		}
+		ok = (fwrite(sig, sizeof(uint64_t), SIGWORDS, index) == SIGWORDS);
+	}
+
+	free(sig);
+	if (map != NULL) {
+		munmap(map, size);
+	}
+	/*a short write (a full disk, say) must not leave an index that queries would trust*/
+	if (fclose(index) != 0 || !ok || rename(tmpName, name) != 0) {
+		printf ("ERROR: Cannot write the index file %s\n", name);
+		unlink(tmpName);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*index_query counts matches of searcher in inFileName using the sidecar index: a match starting in
+  block b puts each of its trigrams in block b or b+1, so only blocks whose combined signatures hold
+  every trigram of the search string are scanned. Returns 1 if the index is missing or stale,
+  so the caller can fall back to scanning the file*/
+int index_query(const char *inFileName, struct searcher *searcher, size_t *size, size_t *matchCount) {
+	struct index_header header;
+	struct stat st, indexSt;
+	char name[4096];
+	const unsigned char *needle = (const unsigned char *)searcher->search;
+	const uint64_t *sigs, *sig, *nextSig;
+	void *indexMap;
+	char *map;
+	size_t m = searcher->searchLen, indexSize, b, i, runStart, stop;
+	uint32_t h, *hashes;
+	int fd, candidate, selected = 0;
+
+	index_name(inFileName, name, sizeof(name));
+	if (stat(inFileName, &st) != 0 || (fd = open(name, O_RDONLY)) < 0) {
+		return 1;
+	}
+	if (fstat(fd, &indexSt) != 0 || (size_t)indexSt.st_size < sizeof(header) ||
+	    read(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		return 1;
+	}
+
+	/*the index only describes the file it was built from*/
+	if (memcmp(header.magic, INDEXMAGIC, 4) != 0 || header.version != INDEXVERSION ||
+	    header.blockSize != INDEXBLOCK || header.sigBits != SIGBITS ||
+	    header.fileSize != (uint64_t)st.st_size || header.mtimeSec != st.st_mtim.tv_sec ||
+	    header.mtimeNsec != st.st_mtim.tv_nsec ||
+	    (uint64_t)indexSt.st_size != sizeof(header) + header.blocks * SIGWORDS * sizeof(uint64_t)) {
+		close(fd);
+		return 1;
+	}
+
+	indexSize = indexSt.st_size;
+	indexMap = mmap(NULL, indexSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (indexMap == MAP_FAILED) {
+		return 1;
+	}
+	sigs = (const uint64_t *)((const char *)indexMap + sizeof(header));
+
+	if (map_input(inFileName, &map, size) != 0) {
+		munmap(indexMap, indexSize);
+		return -1;
+	}
+	*matchCount = 0;
+
+	/*search strings with no trigram (or longer than a block) make every block a candidate*/
+	if ((hashes = malloc((m > 2 ? m - 2 : 1) * sizeof(uint32_t))) == NULL) {
+		printf("ERROR: Out of memory\n");
+		if (map != NULL) {
+			munmap(map, *size);
+		}
+		munmap(indexMap, indexSize);
+		return -1;
+	}
+	for (i = 0; m >= 3 && m <= INDEXBLOCK && i + 2 < m; i++) {
+		hashes[i] = trigram_hash(needle + i);
+	}
+
+	if (searcher->offsets != NULL) {
+		searcher->offsets->bufBase = map;
+		searcher->offsets->fileBase = 0;
+	}
+
+	runStart = 0;
+	for (b = 0; b <= header.blocks; b++) {
+		candidate = 0;
+		if (b < header.blocks) {
+			candidate = 1;
+			sig = sigs + b * SIGWORDS;
+			nextSig = (b + 1 < header.blocks) ? sig + SIGWORDS : NULL;
+			for (i = 0; m >= 3 && m <= INDEXBLOCK && i + 2 < m; i++) {
+				h = hashes[i];
+				if (!((sig[h / 64] | (nextSig != NULL ? nextSig[h / 64] : 0)) & ((uint64_t)1 << (h % 64)))) {
+					candidate = 0;
+					break;
+				}
+			}
+		}
+		if (candidate) {
+			continue;
+		}
+
+		/*blocks [runStart, b) are candidates: count the matches starting in them*/
+		if (runStart < b) {
+			stop = b * INDEXBLOCK + m - 1;
+			if (stop > *size) {
+				stop = *size;
+			}
+			if (!selected) {
+				searcher_select(searcher, map + runStart * INDEXBLOCK,
+				                stop - runStart * INDEXBLOCK < SAMPLESIZE ? stop - runStart * INDEXBLOCK : SAMPLESIZE);
+				selected = 1;
+			}
+			*matchCount += searcher_count(searcher, map + runStart * INDEXBLOCK, stop - runStart * INDEXBLOCK);
+		}
+		runStart = b + 1;
+	}
+
+	free(hashes);
+	if (map != NULL) {
+		munmap(map, *size);
+	}
+	munmap(indexMap, indexSize);
+	return 0;
+}
+
+
+/*map_input maps the input file read-only; an empty file leaves *map NULL*/
+int map_input(const char *inFileName, char **map, size_t *size) {
+	int fd;
+	struct stat st;
+
+	if ((fd = open(inFileName, O_RDONLY)) < 0) {
+		printf ("ERROR: Cannot open the input file %s\n", inFileName);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("ERROR: fstat failed");
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	*map = NULL;
+
+	/*an empty file cannot be mapped and has no matches*/
+	if (*size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	*map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*map == MAP_FAILED) {
+		perror("ERROR: mmap failed");
+		close(fd);
+		return -1;
+	}
+	/*the mapping stays valid after the descriptor is closed*/
+	close(fd);
+
+	/*we read front to back exactly once: ask for aggressive readahead and early page release*/
+	madvise(*map, *size, MADV_SEQUENTIAL);
+	madvise(*map, *size, MADV_WILLNEED);
+	return 0;
+}
+
+
+/*count_parallel splits the mapping into one range per thread and adds up the per-range counts;
+  in multi-pattern mode the per-range state hits are added into hits instead*/
+size_t count_parallel(const char *map, size_t size, const struct searcher *searcher, struct ac_automaton *ac, size_t *hits, int threads) {
+	struct range_job jobs[MAXTHREADS];
+	pthread_t tids[MAXTHREADS];
+	size_t rangeSize, total = 0;
+	int i, s, started = 0;
+
+	/*don't split small files into ranges that cost more to start than to scan*/
+	if ((size_t)threads > size / MINRANGE) {
+		threads = (size / MINRANGE > 0) ? (int)(size / MINRANGE) : 1;
+	}
+	rangeSize = size / threads;
+
+	for (i = 0; i < threads; i++) {
+		jobs[i].map = map;
+		jobs[i].size = size;
+		jobs[i].start = rangeSize * i;
+		jobs[i].end = (i == threads - 1) ? size : rangeSize * (i + 1);
+		jobs[i].searcher = searcher;
+		jobs[i].matches = 0;
+		jobs[i].ac = ac;
+		jobs[i].hits = NULL;
+		if (ac != NULL && (jobs[i].hits = calloc(ac->states, sizeof(size_t))) == NULL) {
+			printf("ERROR: Out of memory\n");
+			exit(1);
+		}
+	}
+
+	/*range 0 runs on this thread; if a thread can't be started its range is counted here too*/
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, count_range, &jobs[i]) != 0) {
+			break;
+		}
+		started = i;
+	}
+	count_range(&jobs[0]);
+	for (i = started + 1; i < threads; i++) {
+		count_range(&jobs[i]);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (i >= 1 && i <= started) {
+			pthread_join(tids[i], NULL);
+		}
+		total += jobs[i].matches;
+		if (ac != NULL) {
+			for (s = 0; s < ac->states; s++) {
+				hits[s] += jobs[i].hits[s];
+			}
+			free(jobs[i].hits);
+		}
+	}
+	return total;
+}
+
+
+/*count_range counts matches that start inside its range; it reads up to searchLen-1 bytes past
+  the end of the range so a match straddling the boundary is counted once, by the range it starts in.
+  The automaton instead counts matches that end inside the range: it is warmed up on the
+  maxLen-1 bytes before the range without counting, so its state is exact from the first byte*/
+void *count_range(void *arg) {
+	struct range_job *job = arg;
+	size_t stop, warm;
+	int state;
+
+	if (job->ac != NULL) {
+		warm = (job->start > job->ac->maxLen - 1) ? job->start - (job->ac->maxLen - 1) : 0;
+		state = ac_scan(job->ac, job->map + warm, job->start - warm, 0, NULL);
+		ac_scan(job->ac, job->map + job->start, job->end - job->start, state, job->hits);
+		return NULL;
+	}
+
+	stop = job->end + job->searcher->searchLen - 1;
+	if (stop > job->size) {
+		stop = job->size;
+	}
+	job->matches = searcher_count(job->searcher, job->map + job->start, stop - job->start);
+	return NULL;
+}
+
+
+/*ac_load reads one pattern per line from the pattern file and builds the automaton; empty lines are skipped*/
+struct ac_automaton *ac_load(const char *patternFileName) {
+	FILE *patterns;
+	struct ac_automaton *ac;
+	char *line = NULL;
+	size_t lineCap = 0, i;
+	ssize_t len;
+	int state, next, capacity = 0;
+
+	if ((patterns = fopen(patternFileName, "rb")) == NULL) {
+		printf ("ERROR: Cannot open the pattern file %s\n", patternFileName);
+		return NULL;
+	}
+	if ((ac = calloc(1, sizeof(*ac))) == NULL || ac_add_state(ac) != 0) {
+		printf("ERROR: Out of memory\n");
+		exit(1);
+	}
+
+	while ((len = getline(&line, &lineCap, patterns)) != -1) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+
+		/*walk the trie, adding states for the part of the pattern not seen yet*/
+		state = 0;
+		for (i = 0; i < (size_t)len; i++) {
+			next = ac->next[state * ALPHABET + (unsigned char)line[i]];
+			if (next < 0) {
+				if ((next = ac_add_state(ac)) < 0) {
+					printf("ERROR: Out of memory\n");
+					exit(1);
+				}
+				ac->next[state * ALPHABET + (unsigned char)line[i]] = next;
+			}
+			state = next;
+		}
+
+		if (ac->patterns == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			ac->pattern = realloc(ac->pattern, capacity * sizeof(char *));
+			ac->patternLen = realloc(ac->patternLen, capacity * sizeof(size_t));
+			ac->terminal = realloc(ac->terminal, capacity * sizeof(int));
+			if (ac->pattern == NULL || ac->patternLen == NULL || ac->terminal == NULL) {
+				printf("ERROR: Out of memory\n");
+				exit(1);
+			}
+		}
+		if ((ac->pattern[ac->patterns] = malloc(len + 1)) == NULL) {
+			printf("ERROR: Out of memory\n");
+			exit(1);
+		}
+		memcpy(ac->pattern[ac->patterns], line, len + 1);
+		ac->patternLen[ac->patterns] = len;
+		ac->terminal[ac->patterns] = state;
+		ac->patterns++;
+		if ((size_t)len > ac->maxLen) {
+			ac->maxLen = len;
+		}
+	}
+	free(line);
+	fclose(patterns);
+
+	if (ac->patterns == 0) {
+		printf("ERROR: The pattern file %s has no patterns.\n", patternFileName);
+		return NULL;
+	}
+
+	ac_build(ac);
+	return ac;
+}
+
+
+/*ac_add_state appends a state with no transitions and returns its number*/
+int ac_add_state(struct ac_automaton *ac) {
+	int capacity;
+
+	if (ac->states == ac->capacity) {
+		capacity = ac->capacity ? ac->capacity * 2 : 256;
+		ac->next = realloc(ac->next, (size_t)capacity * ALPHABET * sizeof(int));
+		if (ac->next == NULL) {
+			return -1;
+		}
+		ac->capacity = capacity;
+	}
+	memset(ac->next + (size_t)ac->states * ALPHABET, -1, ALPHABET * sizeof(int));
+	return ac->states++;
+}
+
+
+/*ac_build computes failure links breadth first and fills every missing transition with the
+  transition of the failure state, so scanning is a single table lookup per byte*/
+void ac_build(struct ac_automaton *ac) {
+	int head = 0, tail = 0, state, child, c;
+
+	ac->fail = calloc(ac->states, sizeof(int));
+	ac->order = calloc(ac->states, sizeof(int));
+	if (ac->fail == NULL || ac->order == NULL) {
+		printf("ERROR: Out of memory\n");
+		exit(1);
+	}
+
+	/*children of the root fail back to the root*/
+	ac->order[tail++] = 0;
+	for (c = 0; c < ALPHABET; c++) {
+		child = ac->next[c];
+		if (child < 0) {
+			ac->next[c] = 0;
+		} else {
+			ac->fail[child] = 0;
+			ac->order[tail++] = child;
+		}
+	}
+	head = 1;
+
+	while (head < tail) {
+		state = ac->order[head++];
+		for (c = 0; c < ALPHABET; c++) {
+			child = ac->next[state * ALPHABET + c];
+			if (child < 0) {
+				ac->next[state * ALPHABET + c] = ac->next[ac->fail[state] * ALPHABET + c];
+			} else {
+				ac->fail[child] = ac->next[ac->fail[state] * ALPHABET + c];
+				ac->order[tail++] = child;
+			}
+		}
+	}
+}
+
+
+/*ac_scan feeds buf through the automaton starting in state and returns the final state;
+  each visited state gets one hit (hits may be NULL to only advance the state)*/
+int ac_scan(const struct ac_automaton *ac, const char *buf, size_t len, int state, size_t *hits) {
+	const unsigned char *p = (const unsigned char *)buf, *end = p + len;
+	const int *next = ac->next;
+
+	if (hits == NULL) {
+		while (p < end) {
+			state = next[state * ALPHABET + *p++];
+		}
+		return state;
+	}
+	while (p < end) {
+		state = next[state * ALPHABET + *p++];
+		hits[state]++;
+	}
+	return state;
+}
+
+
+/*ac_counts turns per-state hits into per-pattern counts: a pattern ends at every position whose state
+  has the pattern's state on its failure chain, so hits are pushed up the failure links deepest first*/
+void ac_counts(const struct ac_automaton *ac, size_t *hits, size_t *counts) {
+	int i, state;
+
+	for (i = ac->states - 1; i > 0; i--) {
+		state = ac->order[i];
+		hits[ac->fail[state]] += hits[state];
+	}
+	for (i = 0; i < ac->patterns; i++) {
+		counts[i] = hits[ac->terminal[i]];
+	}
+}
+
+
+/*usage prints the command format and exits*/
+void usage(void) {
+	printf("Use the format: count [-m] [-j threads] [-e engine] <inputfile> <searchstring> <outputfile> \n");
+	printf("            or: count [-m] [-j threads] -f <patternfile> <inputfile> <outputfile> \n");
+	printf("  an inputfile of - reads standard input\n");
+	printf("  -m  memory-map the input and search it directly (binary safe)\n");
+	printf("  -j  count the mapping with this many threads (implies -m); in batch mode, number of workers\n");
+	printf("  -f  count every pattern in patternfile (one per line) in a single pass\n");
+	printf("  -e  force a search engine: simd, bmh, twoway (default: auto)\n");
+	printf("  -l  count every file named in listfile (one per line, - for stdin) in place of inputfile\n");
+	printf("  a directory as inputfile counts every regular file below it\n");
+	printf("  -X  build the sidecar index inputfile%s, then answer from it\n", INDEXSUFFIX);
+	printf("  -x  answer from the sidecar index, scanning the file if the index is stale\n");
+	printf("  -o  write every match offset to outputfile: varint (delta-encoded) or text\n");
+	exit(1);
 }
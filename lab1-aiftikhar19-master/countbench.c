@@ -0,0 +1,430 @@
+/*Filename: countbench.c
+  Synopsis: benchmark driver for count. Generates synthetic corpora (text, random binary and
+            low-entropy repeated data) at the requested sizes, runs every count search mode
+            against them and prints one CSV line per run:
+		corpus,size,mode,seconds,mb_per_s,matches,peak_rss_kb
+	    batch mode gets one more line per size, corpus "all": the three corpora in one
+	    directory, counted by the worker pool
+	    run the program using countbench [-d corpus-dir] [-c count-binary] [-r repeats] [-j threads] <size>...
+	    sizes take a K, M or G suffix (e.g. 1K 1M 1G)
+	    countbench -g <text|binary|repeat> <size> <file> only writes one corpus file
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MAXARGS 16
+#define GENBUFFER (1 << 20)
+/*string every mode searches for; the text and repeat corpora contain it*/
+#define SEARCH "packet"
+/*patterns written to the pattern file for the multi-pattern mode*/
+#define PATTERNS 100
+
+/*one way of running count*/
+struct bench_mode {
+	const char *name;
+	const char *args[6];	/*options placed before the input file name*/
+	int multi;		/*takes a pattern file instead of the search string*/
+};
+
+/*words the text corpus is made of*/
+static const char *words[] = {
+	"the", "network", "packet", "socket", "server", "client", "port", "address", "buffer",
+	"stream", "datagram", "header", "payload", "checksum", "timeout", "route", "of", "and",
+	"a", "to", "in", "is", "that", "for", "with", "on", "connection", "transfer", "file"
+};
+
+/*Function Declarations*/
+uint64_t next_random(uint64_t *state);
+size_t parse_size(const char *arg);
+int generate(const char *type, size_t size, const char *fileName);
+int write_patterns(const char *fileName);
+int run_count(char *const argv[], double *seconds, size_t *matches, long *rssKb);
+void usage(void);
+
+/*Main*/
+int main(int argc, char *argv[]) {
+	/*variable declarations*/
+	const char *dir = "/tmp/countbench", *countBin = "./count";
+	const char *corpora[] = { "text", "binary", "repeat" };
+	char threadArg[16], corpus[4096], patterns[4096], output[4096 + 8];
+	char batchDir[4096], linkName[4096 + 16];
+	char *args[MAXARGS];
+	struct bench_mode modes[] = {
+		{ "stream", { NULL }, 0 },
+		{ "stdin", { NULL }, 0 },
+		{ "mmap", { "-m", NULL }, 0 },
+		{ "threads", { "-j", threadArg, NULL }, 0 },
+		{ "simd", { "-m", "-e", "simd", NULL }, 0 },
+		{ "bmh", { "-m", "-e", "bmh", NULL }, 0 },
+		{ "twoway", { "-m", "-e", "twoway", NULL }, 0 },
+		{ "multi", { "-m", "-f", patterns, NULL }, 1 },
+		{ "offsets", { "-m", "-o", "varint", NULL }, 0 },
+		{ "index-build", { "-X", NULL }, 0 },
+		{ "index", { "-x", NULL }, 0 },
+	};
+	int nmodes = sizeof(modes) / sizeof(modes[0]);
+	int opt, repeats = 3, threads, c, m, r, i, n;
+	double seconds, best;
+	size_t size, matches;
+	long rssKb, peak;
+	struct stat st;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	/*write a single corpus and stop*/
+	if (argc == 5 && strcmp(argv[1], "-g") == 0) {
+		return generate(argv[2], parse_size(argv[3]), argv[4]) == 0 ? 0 : 1;
+	}
+
+	/*Read options*/
+	while ((opt = getopt(argc, argv, "d:c:r:j:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'c':
+			countBin = optarg;
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc || repeats < 1 || threads < 1) {
+		usage();
+	}
+	snprintf(threadArg, sizeof(threadArg), "%d", threads);
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		printf("ERROR: Cannot create the corpus directory %s\n", dir);
+		exit(1);
+	}
+	snprintf(patterns, sizeof(patterns), "%s/patterns", dir);
+	snprintf(output, sizeof(output), "%s/output", dir);
+	if (write_patterns(patterns) != 0) {
+		exit(1);
+	}
+
+	printf("corpus,size,mode,seconds,mb_per_s,matches,peak_rss_kb\n");
+	for (i = optind; i < argc; i++) {
+		size = parse_size(argv[i]);
+		for (c = 0; c < 3; c++) {
+			/*corpora are deterministic, so one of the right size can be reused*/
+			snprintf(corpus, sizeof(corpus), "%s/%s-%s", dir, corpora[c], argv[i]);
+			if ((stat(corpus, &st) != 0 || (size_t)st.st_size != size) && generate(corpora[c], size, corpus) != 0) {
+				exit(1);
+			}
+			/*an index left over from an earlier run must not answer the index-build row*/
+			snprintf(output, sizeof(output), "%s.cidx", corpus);
+			unlink(output);
+			snprintf(output, sizeof(output), "%s/output", dir);
+
+			for (m = 0; m < nmodes; m++) {
+				best = -1;
+				peak = 0;
+				matches = 0;
+				for (r = 0; r < repeats; r++) {
+					/*count [mode options] <input> [search] <output>; stdin mode reads the corpus through a pipe*/
+					n = 0;
+					args[n++] = (char *)countBin;
+					while (modes[m].args[n - 1] != NULL) {
+						args[n] = (char *)modes[m].args[n - 1];
+						n++;
+					}
+					args[n++] = (strcmp(modes[m].name, "stdin") == 0) ? "-" : corpus;
+					if (!modes[m].multi) {
+						args[n++] = SEARCH;
+					}
+					args[n++] = output;
+					args[n] = NULL;
+
+					if (strcmp(modes[m].name, "stdin") == 0) {
+						/*countbench's stdin is replaced by the corpus for this one run*/
+						int fd = open(corpus, O_RDONLY), saved = dup(STDIN_FILENO);
+						dup2(fd, STDIN_FILENO);
+						close(fd);
+						fd = run_count(args, &seconds, &matches, &rssKb);
+						dup2(saved, STDIN_FILENO);
+						close(saved);
+						if (fd != 0) {
+							exit(1);
+						}
+					} else if (run_count(args, &seconds, &matches, &rssKb) != 0) {
+						exit(1);
+					}
+					if (best < 0 || seconds < best) {
+						best = seconds;
+					}
+					if (rssKb > peak) {
+						peak = rssKb;
+					}
+				}
+				printf("%s,%zu,%s,%.6f,%.1f,%zu,%ld\n", corpora[c], size, modes[m].name, best,
+				       best > 0 ? size / best / 1e6 : 0.0, matches, peak);
+				fflush(stdout);
+			}
+		}
+
+		/*batch mode: the three corpora of this size, linked into a directory of their own,
+		  counted by a pool of threads workers*/
+		snprintf(batchDir, sizeof(batchDir), "%s/batch-%s", dir, argv[i]);
+		if (mkdir(batchDir, 0755) != 0 && errno != EEXIST) {
+			printf("ERROR: Cannot create the batch directory %s\n", batchDir);
+			exit(1);
+		}
+		for (c = 0; c < 3; c++) {
+			snprintf(corpus, sizeof(corpus), "%s/%s-%s", dir, corpora[c], argv[i]);
+			snprintf(linkName, sizeof(linkName), "%s/%s", batchDir, corpora[c]);
+			unlink(linkName);
+			if (link(corpus, linkName) != 0 && generate(corpora[c], size, linkName) != 0) {
+				exit(1);
+			}
+		}
+		n = 0;
+		args[n++] = (char *)countBin;
+		args[n++] = "-j";
+		args[n++] = threadArg;
+		args[n++] = batchDir;
+		args[n++] = SEARCH;
+		args[n++] = output;
+		args[n] = NULL;
+		best = -1;
+		peak = 0;
+		matches = 0;
+		for (r = 0; r < repeats; r++) {
+			if (run_count(args, &seconds, &matches, &rssKb) != 0) {
+				exit(1);
+			}
+			if (best < 0 || seconds < best) {
+				best = seconds;
+			}
+			if (rssKb > peak) {
+				peak = rssKb;
+			}
+		}
+		printf("all,%zu,batch,%.6f,%.1f,%zu,%ld\n", 3 * size, best,
+		       best > 0 ? 3 * size / best / 1e6 : 0.0, matches, peak);
+		fflush(stdout);
+	}
+	return 0;
+}
+
+
+/*next_random is xorshift64*: fast, and the same corpus comes out every run*/
+uint64_t next_random(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+
+/*parse_size reads a byte count with an optional K, M or G suffix*/
+size_t parse_size(const char *arg) {
+	char *end;
+	size_t size = strtoull(arg, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K':
+		return size << 10;
+	case 'm': case 'M':
+		return size << 20;
+	case 'g': case 'G':
+		return size << 30;
+	default:
+		return size;
+	}
+}
+
+
+/*generate writes size bytes of the given corpus type to fileName:
+  text is words from a small networking vocabulary, binary is uniformly random bytes and repeat is
+  one 64-byte unit over a 4-letter alphabet repeated, with the search string written over about one
+  unit in 64. A file that cannot be written completely is removed*/
+int generate(const char *type, size_t size, const char *fileName) {
+	FILE *out;
+	char *buf, unit[64];
+	uint64_t state = 0x9E3779B97F4A7C15ULL, r;
+	size_t written = 0, n, i, len;
+	const char *word;
+	int kind;
+
+	if (strcmp(type, "text") == 0) {
+		kind = 0;
+	} else if (strcmp(type, "binary") == 0) {
+		kind = 1;
+	} else if (strcmp(type, "repeat") == 0) {
+		kind = 2;
+	} else {
+		printf("ERROR: Unknown corpus type %s\n", type);
+		return -1;
+	}
+
+	if ((out = fopen(fileName, "wb")) == NULL) {
+		printf("ERROR: Cannot open the corpus file %s\n", fileName);
+		return -1;
+	}
+	if ((buf = malloc(GENBUFFER + 64)) == NULL) {
+		printf("ERROR: Out of memory\n");
+		fclose(out);
+		unlink(fileName);
+		return -1;
+	}
+	for (i = 0; i < sizeof(unit); i++) {
+		unit[i] = 'a' + next_random(&state) % 4;
+	}
+
+	while (written < size) {
+		n = 0;
+		while (n < GENBUFFER) {
+			r = next_random(&state);
+			if (kind == 0) {
+				word = words[r % (sizeof(words) / sizeof(words[0]))];
+				len = strlen(word);
+				memcpy(buf + n, word, len);
+				buf[n + len] = (r >> 32) % 16 == 0 ? '\n' : ' ';
+				n += len + 1;
+			} else if (kind == 1) {
+				memcpy(buf + n, &r, 8);
+				n += 8;
+			} else {
+				memcpy(buf + n, unit, sizeof(unit));
+				if ((r >> 40) % 64 == 0) {
+					memcpy(buf + n + r % (sizeof(unit) - strlen(SEARCH)), SEARCH, strlen(SEARCH));
+				}
+				n += sizeof(unit);
+			}
+		}
+		if (n > size - written) {
+			n = size - written;
+		}
+		if (fwrite(buf, 1, n, out) != n) {
+			printf("ERROR: Cannot write the corpus file %s\n", fileName);
+			free(buf);
+			fclose(out);
+			unlink(fileName);
+			return -1;
+		}
+		written += n;
+	}
+
+	free(buf);
+	if (fclose(out) != 0) {
+		printf("ERROR: Cannot write the corpus file %s\n", fileName);
+		unlink(fileName);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*write_patterns writes the pattern file for the multi-pattern mode: the search string, the
+  vocabulary, and made-up signatures that mostly don't occur*/
+int write_patterns(const char *fileName) {
+	FILE *out;
+	uint64_t state = 42;
+	size_t i, j;
+
+	if ((out = fopen(fileName, "w")) == NULL) {
+		printf("ERROR: Cannot open the pattern file %s\n", fileName);
+		return -1;
+	}
+	fprintf(out, "%s\n", SEARCH);
+	for (i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+		fprintf(out, "%s\n", words[i]);
+	}
+	for (; i < PATTERNS; i++) {
+		for (j = 0; j < 8 + i % 8; j++) {
+			fputc('a' + next_random(&state) % 26, out);
+		}
+		fputc('\n', out);
+	}
+	fclose(out);
+	return 0;
+}
+
+
+/*run_count runs count with argv, timing it and reading the match total from its output;
+  peak RSS comes from the child's resource usage*/
+int run_count(char *const argv[], double *seconds, size_t *matches, long *rssKb) {
+	struct timespec start, end;
+	struct rusage usage;
+	char line[4096];
+	const char *found;
+	int fds[2], status;
+	pid_t pid;
+	FILE *childOut;
+
+	if (pipe(fds) != 0) {
+		perror("ERROR: pipe failed");
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((pid = fork()) < 0) {
+		perror("ERROR: fork failed");
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execv(argv[0], argv);
+		perror("ERROR: exec failed");
+		_exit(127);
+	}
+	close(fds[1]);
+
+	/*the last "Number of matches" line is the total*/
+	childOut = fdopen(fds[0], "r");
+	while (fgets(line, sizeof(line), childOut) != NULL) {
+		if ((found = strstr(line, "Number of matches: ")) == line) {
+			*matches = strtoull(found + strlen("Number of matches: "), NULL, 10);
+		}
+	}
+	fclose(childOut);
+
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		perror("ERROR: wait4 failed");
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("ERROR: %s exited with status %d\n", argv[0], WEXITSTATUS(status));
+		return -1;
+	}
+
+	*seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	*rssKb = usage.ru_maxrss;
+	return 0;
+}
+
+
+/*usage prints the command format and exits*/
+void usage(void) {
+	printf("Use the format: countbench [-d corpus-dir] [-c count-binary] [-r repeats] [-j threads] <size>...\n");
+	printf("            or: countbench -g <text|binary|repeat> <size> <file>\n");
+	printf("  sizes take a K, M or G suffix, e.g. countbench 1K 1M 1G\n");
+	exit(1);
+}
@@ -0,0 +1,381 @@
+/*Filename: ftpbench.c
+  Synopsis: loopback benchmark for ftpc. Starts each receiver (ftps_uring and ftps by default) on
+            a local port, sends generated random files of the requested sizes with ftpc -S and
+            prints one CSV line per receiver, client mode and size:
+		server,mode,size,seconds,gb_per_s,status
+	    seconds is the best ftpc total_s over the repeats and gb_per_s is size / seconds / 1e9,
+	    so the numbers are end to end: connect, header, data, fallocate, writes and reply.
+	    run the program using ftpbench [-d dir] [-c ftpc-binary] [-s server-binary] [-p port] [-r repeats] <size>...
+	    the first receiver listens on port, the next on port + 1 and so on
+	    a run still going after RUNWAIT seconds is killed and gets status 124
+	    sizes take a K, M or G suffix (e.g. 1M 256M 1G)
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAXSERVERS 8
+#define GENBUFFER (1 << 20)
+#define STARTWAIT 5		/*seconds to wait for a receiver to listen*/
+#define RUNWAIT 120		/*seconds before a stuck ftpc run is killed*/
+#define TIMEDOUT 124		/*status of a killed run, as with timeout(1)*/
+
+/*one way of running ftpc*/
+struct bench_mode {
+	const char *name;
+	const char *args[4];	/*options placed before the address*/
+};
+
+/*Function Declarations*/
+uint64_t next_random(uint64_t *state);
+size_t parse_size(const char *arg);
+int generate(size_t size, const char *fileName);
+pid_t start_server(const char *server, const char *dir, const char *port);
+int run_ftpc(char *const argv[], const char *dir, double *seconds, int *status);
+double json_number(const char *line, const char *key);
+void usage(void);
+
+/*Main*/
+int main(int argc, char *argv[]) {
+	/*variable declarations*/
+	const char *dir = "/tmp/ftpbench", *ftpcBin = "./ftpc", *port = "5462";
+	const char *servers[MAXSERVERS] = { "./ftps_uring", "./ftps" };
+	char file[4096], recvDir[4096], received[4096 + 32], ftpcPath[PATH_MAX], serverPath[PATH_MAX];
+	char portArg[16], *args[16], *base;
+	struct bench_mode modes[] = {
+		{ "sendfile", { NULL } },
+		{ "buffered", { "-b", NULL } },
+		{ "ranges4", { "-n", "4", NULL } },
+	};
+	int nmodes = sizeof(modes) / sizeof(modes[0]);
+	int nservers = 2, userServers = 0;
+	int opt, repeats = 3, s, m, r, i, n, status, worst;
+	double seconds, best;
+	size_t size;
+	struct stat st;
+	pid_t pid;
+
+	/*Read options*/
+	while ((opt = getopt(argc, argv, "d:c:s:p:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'c':
+			ftpcBin = optarg;
+			break;
+		case 's':
+			/*the first -s replaces the default receivers*/
+			if (userServers == MAXSERVERS) {
+				usage();
+			}
+			servers[userServers++] = optarg;
+			nservers = userServers;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc || repeats < 1) {
+		usage();
+	}
+
+	snprintf(recvDir, sizeof(recvDir), "%s/recv", dir);
+	if ((mkdir(dir, 0755) != 0 && errno != EEXIST) || (mkdir(recvDir, 0755) != 0 && errno != EEXIST)) {
+		printf("ERROR: Cannot create the benchmark directory %s\n", dir);
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	/*both programs run in other directories, so find them now*/
+	if (realpath(ftpcBin, ftpcPath) == NULL) {
+		printf("ERROR: Cannot find %s\n", ftpcBin);
+		exit(1);
+	}
+
+	printf("server,mode,size,seconds,gb_per_s,status\n");
+	for (s = 0; s < nservers; s++) {
+		if (realpath(servers[s], serverPath) == NULL) {
+			printf("ERROR: Cannot find %s\n", servers[s]);
+			exit(1);
+		}
+		/*each receiver gets its own port: a listening socket with an io_uring accept pending
+		  can outlive its process for a moment*/
+		snprintf(portArg, sizeof(portArg), "%d", atoi(port) + s);
+		if ((pid = start_server(serverPath, recvDir, portArg)) < 0) {
+			exit(1);
+		}
+		for (i = optind; i < argc; i++) {
+			size = parse_size(argv[i]);
+			/*files are deterministic, so one of the right size can be reused*/
+			snprintf(file, sizeof(file), "%s/bench-%s", dir, argv[i]);
+			if ((stat(file, &st) != 0 || (size_t)st.st_size != size) && generate(size, file) != 0) {
+				kill(pid, SIGTERM);
+				exit(1);
+			}
+			base = strrchr(file, '/') + 1;
+			snprintf(received, sizeof(received), "%s/recvd_%s", recvDir, base);
+
+			for (m = 0; m < nmodes; m++) {
+				best = -1;
+				worst = 0;
+				for (r = 0; r < repeats; r++) {
+					/*ftpc -S [mode options] 127.0.0.1 <port> <file>, run in dir since only
+					  20 bytes of the name are sent*/
+					n = 0;
+					args[n++] = ftpcPath;
+					args[n++] = "-S";
+					while (modes[m].args[n - 2] != NULL) {
+						args[n] = (char *)modes[m].args[n - 2];
+						n++;
+					}
+					args[n++] = "127.0.0.1";
+					args[n++] = portArg;
+					args[n++] = base;
+					args[n] = NULL;
+
+					/*every run creates the file from scratch*/
+					unlink(received);
+					if (run_ftpc(args, dir, &seconds, &status) != 0) {
+						kill(pid, SIGTERM);
+						exit(1);
+					}
+					if (status != 0) {
+						worst = status;
+					}
+					if (best < 0 || seconds < best) {
+						best = seconds;
+					}
+				}
+				if (worst == 0 && (stat(received, &st) != 0 || (size_t)st.st_size != size)) {
+					printf("ERROR: %s did not store %s\n", servers[s], received);
+					worst = 1;
+				}
+				printf("%s,%s,%zu,%.6f,%.3f,%d\n", servers[s], modes[m].name, size, best,
+				       best > 0 ? size / best / 1e9 : 0.0, worst);
+				fflush(stdout);
+			}
+			unlink(received);
+		}
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	return 0;
+}
+
+
+/*next_random is xorshift64*: fast, and the same file comes out every run*/
+uint64_t next_random(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+
+/*parse_size reads a byte count with an optional K, M or G suffix*/
+size_t parse_size(const char *arg) {
+	char *end;
+	size_t size = strtoull(arg, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K':
+		return size << 10;
+	case 'm': case 'M':
+		return size << 20;
+	case 'g': case 'G':
+		return size << 30;
+	default:
+		return size;
+	}
+}
+
+
+/*generate writes size random bytes to fileName*/
+int generate(size_t size, const char *fileName) {
+	FILE *out;
+	char *buf;
+	uint64_t state = 0x9E3779B97F4A7C15ULL, r;
+	size_t written = 0, n;
+
+	if ((out = fopen(fileName, "wb")) == NULL) {
+		printf("ERROR: Cannot open the benchmark file %s\n", fileName);
+		return -1;
+	}
+	if ((buf = malloc(GENBUFFER)) == NULL) {
+		printf("ERROR: Out of memory\n");
+		return -1;
+	}
+	while (written < size) {
+		for (n = 0; n < GENBUFFER; n += 8) {
+			r = next_random(&state);
+			memcpy(buf + n, &r, 8);
+		}
+		n = (size - written) < GENBUFFER ? (size - written) : GENBUFFER;
+		if (fwrite(buf, 1, n, out) != n) {
+			printf("ERROR: Cannot write the benchmark file %s\n", fileName);
+			return -1;
+		}
+		written += n;
+	}
+	free(buf);
+	fclose(out);
+	return 0;
+}
+
+
+/*start_server runs server on port with dir as its working directory, so its recvd_ files land
+  there, and waits until it accepts connections. Returns its pid or -1*/
+pid_t start_server(const char *server, const char *dir, const char *port) {
+	struct sockaddr_in addr;
+	struct timespec pause = { 0, 10 * 1000 * 1000 };
+	int sock, tries, devnull, status;
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		perror("ERROR: fork failed");
+		return -1;
+	}
+	if (pid == 0) {
+		/*keep the receiver's per-file messages out of the CSV*/
+		if ((devnull = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(devnull, STDOUT_FILENO);
+			close(devnull);
+		}
+		if (chdir(dir) != 0) {
+			perror("ERROR: chdir failed");
+			_exit(127);
+		}
+		execl(server, server, port, (char *)NULL);
+		perror("ERROR: exec failed");
+		_exit(127);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(atoi(port));
+	for (tries = 0; tries < STARTWAIT * 100; tries++) {
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			printf("ERROR: %s exited before it was ready\n", server);
+			return -1;
+		}
+		/*an empty connection is just closed by the receiver*/
+		if ((sock = socket(AF_INET, SOCK_STREAM, 0)) >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			close(sock);
+			return pid;
+		}
+		if (sock >= 0) {
+			close(sock);
+		}
+		nanosleep(&pause, NULL);
+	}
+	printf("ERROR: %s is not listening on port %s\n", server, port);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+
+/*run_ftpc runs ftpc with argv in dir and reads total_s and status from its -S line. status is
+  the transfer status reported by ftpc, or its exit status if it printed no -S line*/
+int run_ftpc(char *const argv[], const char *dir, double *seconds, int *status) {
+	char line[4096];
+	int fds[2], exitStatus, found = 0;
+	pid_t pid;
+	FILE *childOut;
+
+	if (pipe(fds) != 0) {
+		perror("ERROR: pipe failed");
+		return -1;
+	}
+	if ((pid = fork()) < 0) {
+		perror("ERROR: fork failed");
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		/*the alarm survives exec, so a run that never gets its reply ends*/
+		alarm(RUNWAIT);
+		if (chdir(dir) != 0) {
+			perror("ERROR: chdir failed");
+			_exit(127);
+		}
+		execv(argv[0], argv);
+		perror("ERROR: exec failed");
+		_exit(127);
+	}
+	close(fds[1]);
+
+	childOut = fdopen(fds[0], "r");
+	while (fgets(line, sizeof(line), childOut) != NULL) {
+		if (line[0] == '{' && strstr(line, "\"total_s\":") != NULL) {
+			*seconds = json_number(line, "total_s");
+			*status = (int)json_number(line, "status");
+			found = 1;
+		}
+	}
+	fclose(childOut);
+
+	if (waitpid(pid, &exitStatus, 0) < 0) {
+		perror("ERROR: waitpid failed");
+		return -1;
+	}
+	if (WIFSIGNALED(exitStatus) && WTERMSIG(exitStatus) == SIGALRM) {
+		printf("ERROR: an ftpc run did not finish in %d seconds\n", RUNWAIT);
+		*seconds = 0;
+		*status = TIMEDOUT;
+	} else if (!found) {
+		*seconds = 0;
+		*status = WIFEXITED(exitStatus) ? WEXITSTATUS(exitStatus) : 1;
+		if (*status == 0) {
+			*status = 1;
+		}
+	}
+	return 0;
+}
+
+
+/*json_number returns the number after "key": in line, or 0 if the key is missing*/
+double json_number(const char *line, const char *key) {
+	char pattern[64];
+	const char *p;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	if ((p = strstr(line, pattern)) == NULL) {
+		return 0;
+	}
+	return strtod(p + strlen(pattern), NULL);
+}
+
+
+/*usage prints the command format and exits*/
+void usage(void) {
+	printf("Use the format: ftpbench [-d dir] [-c ftpc-binary] [-s server-binary] [-p port] [-r repeats] <size>...\n");
+	printf("  sizes take a K, M or G suffix, e.g. ftpbench 1M 256M 1G\n");
+	printf("  -s may be given up to %d times; the default is -s ./ftps_uring -s ./ftps\n", MAXSERVERS);
+	exit(1);
+}
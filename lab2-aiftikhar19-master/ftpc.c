@@ -3,8 +3,25 @@
   Created by: Aisha Iftikhar
   Creation date: 1/16/20
   Synopsis: This project is a client side code for a file transfer protocol. 
+            File data goes from the page cache to the socket with sendfile (falling back to splice,
+            then to large buffered writes), so it never passes through user space.
+            With -n N the file is split into N byte ranges sent over N concurrent connections
+            (extended header, see ftps.c). With -d only the parts of the file the server does not
+            already have are sent: the server returns rolling/strong checksums of its copy's blocks
+            and the client answers with literal data and block references. With -p any number of
+            files are streamed back to back over one connection in length-prefixed frames, and the
+            server's per-file acknowledgements are read as they arrive instead of one round trip each.
+            With -c the data is sent as zlib blocks; blocks that a quick sample shows will not
+            shrink are sent raw. With -k a CRC32C of the data (SSE4.2 crc32 when the CPU has it) is
+            computed while it is sent and follows it as a trailer for the server to verify.
+            With -e a job file of "host port file" lines is uploaded by one thread: non-blocking
+            sockets driven by epoll, a bounded buffer per upload and a global cap on buffered bytes.
+            -S prints one JSON line of per-phase timings, throughput and syscall counts at the end.
 */
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -14,48 +31,338 @@
 #include <strings.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <sys/epoll.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_CRC 1
+#endif
 
 #define MAX 100
+/*largest chunk handed to sendfile/splice in one call, and buffer size for the fallback copy*/
+#define CHUNK (1 << 20)
+#define NAMELEN 20		/*file name field in the header*/
+#define MAXSTREAMS 64		/*most connections -n will open*/
+#define RANGEALIGN (1 << 16)	/*range boundaries are rounded to this many bytes*/
+
+/*Extended header: a size of EXT_MARKER tells the server that, after the usual name field, a
+  range header follows: u8 version, u8 flags, u16 streams, u64 file size, u64 range offset,
+  u64 range length (network byte order). The reply is u32 code, ' ', u64 bytes received*/
+#define EXT_MARKER 0xFFFFFFFFu
+#define EXT_VERSION 1
+#define EXT_HEADER (4 + 1 + NAMELEN + 1 + 1 + 1 + 2 + 8 + 8 + 8)
+
+/*Extended header flags*/
+#define FLAG_DELTA 0x01		/*delta transfer against the server's existing copy*/
+#define FLAG_MULTI 0x02		/*a stream of framed files follows*/
+#define FLAG_COMPRESS 0x04	/*data is sent as compressed blocks*/
+#define FLAG_CRC 0x08		/*a u32 CRC32C of the data follows it*/
+
+/*Multi-file stream: after the extended header (size = total bytes, name unused) each file is
+  u16 name length, name, u64 size, data; a zero name length ends the stream. The server sends
+  u32 index, u32 code, u64 size for every file as it completes, then the usual reply*/
+#define MAXNAME 4096		/*longest name in a frame*/
+#define ACKSIZE (4 + 4 + 8)
+
+/*Compressed data: each block is u8 type ('Z' zlib or 'R' raw), u32 raw length, u32 stored
+  length, then the stored bytes. Before compressing a block, a SAMPLESIZE slice from its middle
+  is compressed; if that does not get below SAMPLERATIO percent the block goes raw*/
+#define BLOCKSIZE (1 << 18)
+#define BLOCKHEADER (1 + 4 + 4)
+#define SAMPLESIZE 4096
+#define SAMPLERATIO 90
+
+#define CRC32C_POLY 0x82F63B78u	/*Castagnoli polynomial, reflected*/
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+/*Upload engine (-e)*/
+#define ENGINEBUFFER (1 << 18)	/*buffer per upload*/
+#define ENGINECONNS 64		/*default for -j, uploads in progress at once*/
+#define ENGINEBUDGET 64		/*default for -B, MB of file data buffered across all uploads*/
+#define ENGINEEVENTS 64		/*events per epoll_wait*/
+#define MAXJOBS 4096
+
+/*Transfer phases timed by -S*/
+#define PH_RESOLVE 0
+#define PH_CONNECT 1
+#define PH_HEADER 2
+#define PH_DATA 3
+#define PH_REPLY 4
+#define PHASES 5
+
+/*states of an upload*/
+#define UP_CONNECTING 0
+#define UP_SENDING 1
+#define UP_WAITING 2		/*buffer empty and the budget is used up; off epoll*/
+#define UP_REPLY 3
+#define UP_DONE 4
+
+/*Delta transfer: the server answers the header with u32 block size, u32 block count, u64 size
+  of its copy and then, per block, u32 weak sum and a 16-byte strong hash. The client replies
+  with tokens: 'L' u32 length + data, 'B' u32 block index, 'E' end*/
+#define SIGSIZE (4 + 16)	/*one block signature*/
+#define TOKENBUFFER (1 << 16)	/*tokens are batched into writes of this size*/
+#define MAXLITERAL CHUNK	/*longest literal run in one token*/
+#define BUCKET(v, bits) (((uint32_t)(v) * 2654435761u) >> (32 - (bits)))
+
+/*block signature received from the server*/
+struct block_sig {
+	uint32_t weak;			/*rolling checksum*/
+	unsigned char strong[16];	/*MurmurHash3 x64 128*/
+	int next;			/*next block in the same hash bucket, -1 at the end*/
+};
+
+/*batches delta tokens so a run of block references goes out in one write*/
+struct token_writer {
+	int sock;
+	size_t len;			/*bytes waiting in buf*/
+	off_t shipped;			/*total bytes written to the socket*/
+	unsigned char buf[TOKENBUFFER];
+};
+
+/*one byte range sent over its own connection*/
+struct range_job {
+	struct sockaddr_in *addr;	/*server to connect to*/
+	int fd;				/*file being sent*/
+	const char *name;		/*name sent in the header*/
+	off_t size;			/*size of the whole file*/
+	off_t offset;			/*first byte of this range*/
+	off_t length;			/*bytes in this range*/
+	int streams;			/*total number of ranges*/
+	int buffered;			/*copy through a buffer instead of sendfile*/
+	int level;			/*zlib level, 0 to send uncompressed*/
+	int check;			/*send a CRC32C trailer*/
+	off_t wire;			/*data bytes that went on the wire*/
+	int code;			/*return code from the server, -1 if the transfer failed locally*/
+	off_t received;			/*bytes the server says it received*/
+};
+
+/*counters behind -S; updated with atomic adds since -n sends from several threads*/
+struct transfer_stats {
+	uint64_t phase_us[PHASES];	/*time in each phase, summed over connections*/
+	uint64_t connections;		/*connections opened*/
+	uint64_t writes;		/*write() calls on sockets*/
+	uint64_t sendfiles;		/*sendfile() calls*/
+	uint64_t splices;		/*splice() calls, both halves*/
+	uint64_t reads;			/*read(), recv() and pread() calls*/
+	uint64_t sockwrites;		/*calls that put data on a socket*/
+	uint64_t wire;			/*bytes those calls put on the socket*/
+};
+
+/*one upload driven by the engine*/
+struct upload {
+	char *host;			/*server, as given in the job file*/
+	int port;
+	struct sockaddr_in addr;	/*resolved before any upload starts; sin_family is 0 for an unknown host*/
+	char *path;			/*file to send*/
+	int fd;				/*file, -1 until opened*/
+	int sock;			/*non-blocking socket, -1 until started*/
+	int state;			/*UP_* */
+	int extended;			/*size needs the 64-bit header*/
+	off_t size;			/*file size*/
+	off_t readpos;			/*file bytes read into buf so far*/
+	unsigned char *buf;		/*header, then file data*/
+	size_t head, tail;		/*unsent bytes are buf[head, tail)*/
+	size_t charged;			/*bytes of buf counted against the budget*/
+	unsigned char reply[4 + 1 + 8];	/*reply as it arrives*/
+	size_t replylen;
+	int code;			/*return code, -1 for local failures*/
+	off_t received;			/*returned size*/
+	double start;			/*when the connect began*/
+	struct upload *next;		/*next upload waiting for budget*/
+};
+
+/*acknowledgements of a multi-file stream as they come back*/
+struct ack_reader {
+	char **files;			/*names, for reporting failures*/
+	int count;			/*files in the stream*/
+	int acked;			/*acks read so far*/
+	int failed;			/*acks with a nonzero code*/
+	size_t have;			/*bytes of a partial ack in buf*/
+	unsigned char buf[4096];
+};
+
+/*Function Declarations*/
+int write_all(int fd, const void *buf, size_t len);
+int read_all(int fd, void *buf, size_t len);
+void put_be64(unsigned char *p, uint64_t v);
+uint64_t get_be64(const unsigned char *p);
+void name_field(char *field, const char *name);
+int connect_server(struct sockaddr_in *addr);
+int build_ext_header(unsigned char *hdr, const char *name, int flags, int streams, off_t size, off_t offset, off_t length);
+int send_ext_header(int sock, const char *name, int flags, int streams, off_t size, off_t offset, off_t length);
+int send_parallel(struct sockaddr_in *addr, const char *name, int fd, off_t size, int streams, int buffered, int level, int check);
+void *range_worker(void *arg);
+int send_delta(struct sockaddr_in *addr, const char *name, int fd, off_t size, int check);
+off_t delta_tokens(int sock, const unsigned char *data, off_t size, struct block_sig *sigs, int count, uint32_t block, off_t oldsize, uint32_t *crc);
+int token_put(struct token_writer *tw, const void *buf, size_t len);
+int token_flush(struct token_writer *tw);
+uint32_t weak_sum(const unsigned char *p, size_t len);
+void strong_sum(const unsigned char *p, size_t len, unsigned char out[16]);
+int send_multi(struct sockaddr_in *addr, char **files, int count, int buffered, int level, int check);
+int read_acks(int sock, struct ack_reader *ar, int wait);
+int run_engine(const char *jobfile, int conns, off_t budget);
+int engine_start(int ep, struct upload *u, off_t *budget, struct upload **waiting);
+int engine_step(int ep, struct upload *u, off_t *budget, struct upload **waiting);
+void engine_release(int ep, struct upload *u, off_t *budget, struct upload **waiting);
+void engine_finish(int ep, struct upload *u, int code, off_t *budget, struct upload **waiting);
+double now(void);
+void stat_add(uint64_t *counter, uint64_t n);
+void stat_phase(int phase, double since);
+void stat_sent(uint64_t *counter, ssize_t n);
+void stats_report(const char *mode, char **files, int count, off_t size, int status, double start);
+void json_string(const char *s);
+off_t send_data(int sock, int fd, off_t offset, off_t size, int buffered, int level, off_t *wire, uint32_t *crc);
+off_t send_checked(int sock, int fd, off_t offset, off_t size, int buffered, uint32_t *crc);
+off_t send_compressed(int sock, int fd, off_t offset, off_t size, int level, off_t *wire, uint32_t *crc);
+int send_trailer(int sock, uint32_t crc);
+void crc32c_init(void);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len);
+int worth_compressing(const unsigned char *block, size_t len, int level);
+off_t send_file(int sock, int fd, off_t offset, off_t size, int buffered);
+off_t send_sendfile(int sock, int fd, off_t offset, off_t size);
+off_t send_splice(int sock, int fd, off_t offset, off_t size);
+off_t send_buffered(int sock, int fd, off_t offset, off_t size);
+void usage(void);
+
+crc_fn crc32c_kernel;			/*picked once by crc32c_init*/
+uint32_t crc32c_tab[256];
+struct transfer_stats stats;		/*filled in always, printed with -S*/
+int show_stats;				/*-S*/
 
 int main(int argc, char *argv[]) {
 
 	/*Variable declarations*/
-	int sock, size, return_code, return_size, n, bytes_read;	/*vars used to store socket, file size, return codes (from read and write), and bytes_read from fread*/
+	int sock, return_code, n;		/*vars used to store socket, return codes (from read and write)*/
+	uint32_t netsize, return_size;		/*32-bit size fields of the original header and reply*/
+	off_t size;				/*file size*/
+	struct stat st;				/*used to get the file size*/
+	off_t sent;				/*bytes of file data sent*/
+	int opt, buffered = 0;			/*command line option; -b forces the buffered copy path*/
+	int streams = 1;			/*-n: number of parallel connections*/
+	int delta = 0;				/*-d: send only what the server's copy lacks*/
+	int multi = 0;				/*-p: send every listed file over one connection*/
+	int level = 0;				/*-c: zlib level for compressed blocks*/
+	int check = 0;				/*-k: send a CRC32C trailer*/
+	char *jobfile = NULL;			/*-e: uploads to run from one event loop*/
+	int conns = ENGINECONNS;		/*-j: uploads in progress at once*/
+	off_t budget = ENGINEBUDGET;		/*-B: MB buffered across uploads*/
+	double start, t;			/*for -S: start of the run and of the current phase*/
+	char name[NAMELEN];			/*zero padded name field*/
 	struct sockaddr_in serv_addr;		/* structure for socket name setup */
 	struct hostent *server;			/*used to store host address*/
 	FILE *file;				/*used for file to transfer*/
-	char buff[MAX];				/*buffer to store file contents*/
 	char blank[1];				/*used to store blank for syntax*/
 	blank[0] = ' ';
 	
-	/*variables to store input*/
-	char *server_ip = argv[1];
-	int server_port = atoi(argv[2]);
-	char *file_to_transfer = argv[3];
+	/*Read options*/
+	start = now();
+	while ((opt = getopt(argc, argv, "B:bc:de:j:kn:pS")) != -1) {
+		switch (opt) {
+		case 'B':
+			budget = atol(optarg);
+			if (budget < 1) {
+				printf("ERROR: -B must be at least 1 MB\n");
+				exit(1);
+			}
+			break;
+		case 'b':
+			buffered = 1;
+			break;
+		case 'e':
+			jobfile = optarg;
+			break;
+		case 'j':
+			conns = atoi(optarg);
+			if (conns < 1) {
+				printf("ERROR: -j must be at least 1\n");
+				exit(1);
+			}
+			break;
+		case 'c':
+			level = atoi(optarg);
+			if (level < 1 || level > 9) {
+				printf("ERROR: -c level must be between 1 and 9\n");
+				exit(1);
+			}
+			break;
+		case 'd':
+			delta = 1;
+			break;
+		case 'k':
+			check = 1;
+			break;
+		case 'n':
+			streams = atoi(optarg);
+			if (streams < 1 || streams > MAXSTREAMS) {
+				printf("ERROR: -n must be between 1 and %d\n", MAXSTREAMS);
+				exit(1);
+			}
+			break;
+		case 'p':
+			multi = 1;
+			break;
+		case 'S':
+			show_stats = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	
+	/*run every upload in the job file from one thread*/
+	if (jobfile != NULL) {
+		if (argc != optind || delta || multi || level || check || buffered || streams > 1 || show_stats) {
+			printf("ERROR: -e takes no other arguments and only the -j and -B options\n");
+			exit(1);
+		}
+		return run_engine(jobfile, conns, budget << 20);
+	}
 	
 	/*Error check input*/
-	if (argc != 4) {
+	if (argc - optind != 3 && !(multi && argc - optind > 3)) {
 		printf("ERROR: Incorrect number of arguments.\n");
-		printf("Use the format: ftpc <remote-IP> <remote-port> <local-file-to-transfer> \n");
-		exit(0);
+		usage();
 	}
-	
-	/*Initialize socket connection*/
-	if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0){
-		perror("ERROR: Cannot open datagram socket");
-		exit(0);
+	if (delta + multi + (streams > 1) > 1) {
+		printf("ERROR: -d, -n and -p cannot be combined\n");
+		exit(1);
+	}
+	if (delta && level) {
+		printf("ERROR: -c cannot be combined with -d\n");
+		exit(1);
 	}
 	
+	crc32c_init();
+	
+	/*variables to store input*/
+	char *server_ip = argv[optind];
+	int server_port = atoi(argv[optind + 1]);
+	char *file_to_transfer = argv[optind + 2];
+	
 	/*print status*/
 	printf("Initializing connection...\n");
 	
 	/*Connect to host*/
 	/*get host - takes IP address and returns pointer to hostent containing info about host*/
+	t = now();
 	server = gethostbyname(server_ip);	
 	if(server == NULL) {
-		printf("%s: unknown host\n", argv[1]);
+		printf("%s: unknown host\n", server_ip);
 		exit(0);
 	}
+	stat_phase(PH_RESOLVE, t);
 	
 	/*construct name of socket*/
 	/*bzero() sets all values in a buffer to zero*/
@@ -66,49 +373,92 @@ int main(int argc, char *argv[]) {
   	/*second field of serv_addr is unsigned short sin_port , which contain the port number. However, instead of simply copying the port number to this field, it is necessary to convert this to network byte order using the function htons() which converts a port number in host byte order to a port number in network byte order*/
   	serv_addr.sin_port = htons(server_port);
   
+	/*stream all the files over one connection*/
+	if (multi) {
+		n = send_multi(&serv_addr, argv + optind + 2, argc - optind - 2, buffered, level, check);
+		stats_report("multi", argv + optind + 2, argc - optind - 2, -1, n, start);
+		return n;
+	}
+	
+	/*Error check file open */
+	if ((file = fopen(file_to_transfer, "rb")) == NULL) {
+		printf ("ERROR: Cannot open the input file %s\n", file_to_transfer);
+		exit(0);
+	}
+	
+	/*Get file size; off_t is 64 bits even on 32-bit builds (_FILE_OFFSET_BITS)*/
+	if (fstat(fileno(file), &st) != 0) {
+		printf("ERROR: Cannot read the size of %s\n", file_to_transfer);
+		exit(1);
+	}
+	size = st.st_size;
+	
+	/*send only the blocks the server is missing*/
+	if (delta) {
+		n = send_delta(&serv_addr, file_to_transfer, fileno(file), size, check);
+		fclose(file);
+		stats_report("delta", &file_to_transfer, 1, size, n, start);
+		return n;
+	}
+	
+	/*split the file across several connections; compression, checksums and files too big for
+	  the original 32-bit size field also need the extended header*/
+	if (size > INT32_MAX) {
+		printf("File is larger than 2 GB, using the 64-bit header.\n");
+	}
+	if (streams > 1 || level || check || size > INT32_MAX) {
+		n = send_parallel(&serv_addr, file_to_transfer, fileno(file), size, streams, buffered, level, check);
+		fclose(file);
+		stats_report("ranges", &file_to_transfer, 1, size, n, start);
+		return n;
+	}
+	
+	/*Initialize socket connection*/
+	if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+		perror("ERROR: Cannot open datagram socket");
+		exit(0);
+	}
+	
   	/*connect to server*/
   	/*connect takes three arguments: the socket file descriptor, the address of the host to which it wants to connect (including the port number), and the size of this address. This function returns 0 on success and -1 if it fails*/
+	t = now();
   	if(connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
     		close(sock);
     		perror("ERROR: Connection failed");
     		exit(0);
   	}
+	stat_phase(PH_CONNECT, t);
+	stat_add(&stats.connections, 1);
   	
   	/*print status*/
   	printf("Connected.\n");
-	
-	/*Error check file open */
-	if ((file = fopen(file_to_transfer, "rb")) == NULL) {
-		printf ("ERROR: Cannot open the input file %s\n", file_to_transfer);
-		exit(0);
-	}
-	
-	/*Get file size*/
-	fseek(file, 0, SEEK_END);
-	size = ftell(file);
-	fseek(file, 0, SEEK_SET);
+	t = now();
 	
 	/*send size of the file in bytes; convert from host to network long*/
-	size = htonl(size);
-	n = write(sock, &size, 4);
+	netsize = htonl(size);
+	n = write(sock, &netsize, 4);
+	stat_sent(&stats.writes, n);
 	if (n != 4) {
 		printf("ERROR: wrong number bytes sent\n");
 		exit(1);
 	}
 	
 	/*print status*/
-	printf("File Size Sent: %d\n", htonl(size));
+	printf("File Size Sent: %lld\n", (long long)size);
 	
 	/*add single ascii space*/
 	n = write(sock, &blank, 1);
+	stat_sent(&stats.writes, n);
 	if (n != 1) {
 		printf("ERROR: wrong number bytes sent\n");
 		exit(1);
 	}
 	
-	/*send name of file in bytes*/
-	n = write(sock, file_to_transfer, 20);
-	if (n != 20) {
+	/*send name of file in bytes, zero padded to the field size*/
+	name_field(name, file_to_transfer);
+	n = write(sock, name, NAMELEN);
+	stat_sent(&stats.writes, n);
+	if (n != NAMELEN) {
 		printf("ERROR: wrong number bytes sent\n");
 		exit(1);
 	}
@@ -118,43 +468,45 @@ int main(int argc, char *argv[]) {
 	
 	/*add single ascii space*/
 	n = write(sock, &blank, 1);
+	stat_sent(&stats.writes, n);
 	if (n != 1) {
 		printf("ERROR: wrong number bytes sent\n");
 		exit(1);
 	}
+	stat_phase(PH_HEADER, t);
 	
-	/*begin reading data*/
-	while (1) {
-		/*fread returns total number of elements successfully read as a size_t object. If this number differs from the nmemb parameter, then either an error had occurred or the End Of File was reached*/
-		bytes_read = fread(buff, 1, MAX, file);
-		if(bytes_read > 0) {
-			/*while there is still data, send to stream*/
-			write(sock, buff, bytes_read); 
-		}
-		/*as you're reading data, check for end of file*/
-		if (feof(file)) {
-			break;
-		}
+	/*send the file data straight from the page cache*/
+	t = now();
+	sent = send_file(sock, fileno(file), 0, size, buffered);
+	if (sent != size) {
+		printf("ERROR: only %lld of %lld bytes sent\n", (long long)sent, (long long)size);
+		exit(1);
 	}
+	stat_phase(PH_DATA, t);
 	/*print status*/
 	printf("File Sent.\n");
 	
 	/*read return code and returned file size*/
+	t = now();
      	n = read(sock, &return_code, 4);
+	stat_add(&stats.reads, 1);
     	if (n != 4) {
 		printf("ERROR: wrong number bytes read\n");
 		exit(1);
 	}
      	n = read(sock, &blank, 1);
+	stat_add(&stats.reads, 1);
      	if (n != 1) {
 		printf("ERROR: wrong number bytes read\n");
 		exit(1);
 	}
      	n = read(sock, &return_size, 4);
+	stat_add(&stats.reads, 1);
      	if (n != 4) {
 		printf("ERROR: wrong number bytes read\n");
 		exit(1);
 	}
+	stat_phase(PH_REPLY, t);
      
      	/*convert return codes from network to host long*/
      	return_code = ntohl(return_code);
@@ -162,7 +514,7 @@ int main(int argc, char *argv[]) {
      
      	/*print status*/
      	printf("Returned code: %d\n", return_code);
-     	printf("Returned file size: %d\n", return_size);
+     	printf("Returned file size: %u\n", return_size);
 	
 	/*close file streams*/
 	fclose (file);
@@ -170,6 +522,1450 @@ int main(int argc, char *argv[]) {
 	
 	/*print status*/
 	printf("Transfer complete. Socket closed.\n");
+	stats_report("single", &file_to_transfer, 1, size, return_code != 0, start);
 
 return 0;
 }
+
+
+/*write_all writes all len bytes, retrying short writes; returns 0 on success*/
+int write_all(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		stat_sent(&stats.writes, n);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/*send_data sends a range of the file either as is or, with a level, as compressed blocks. wire
+  is increased by the data bytes put on the socket. Returns the file bytes sent*/
+off_t send_data(int sock, int fd, off_t offset, off_t size, int buffered, int level, off_t *wire, uint32_t *crc) {
+	off_t n;
+
+	if (level) {
+		return send_compressed(sock, fd, offset, size, level, wire, crc);
+	}
+	if (crc != NULL) {
+		n = send_checked(sock, fd, offset, size, buffered, crc);
+	} else {
+		n = send_file(sock, fd, offset, size, buffered);
+	}
+	if (n > 0) {
+		*wire += n;
+	}
+	return n;
+}
+
+
+/*send_checked sends the range CHUNK by CHUNK, running the CRC over a mapping of each chunk just
+  before sendfile sends it. The chunk is then hot in the page cache, so the file is still read
+  from disk once and the data is never copied into the program*/
+off_t send_checked(int sock, int fd, off_t offset, off_t size, int buffered, uint32_t *crc) {
+	unsigned char *map;
+	off_t page = sysconf(_SC_PAGESIZE), start, skew, sent = 0, n, m;
+
+	*crc = 0;
+	while (sent < size) {
+		n = (size - sent) < CHUNK ? (size - sent) : CHUNK;
+		start = (offset + sent) & ~(page - 1);
+		skew = offset + sent - start;
+		map = mmap(NULL, n + skew, PROT_READ, MAP_SHARED, fd, start);
+		if (map == MAP_FAILED) {
+			perror("ERROR: Cannot map the input file");
+			return sent;
+		}
+		*crc = crc32c(*crc, map + skew, n);
+		munmap(map, n + skew);
+		m = send_file(sock, fd, offset + sent, n, buffered);
+		if (m < 0) {
+			return -1;
+		}
+		sent += m;
+		if (m < n) {
+			break;
+		}
+	}
+	return sent;
+}
+
+
+/*send_trailer sends the CRC32C trailer*/
+int send_trailer(int sock, uint32_t crc) {
+	crc = htonl(crc);
+	return write_all(sock, &crc, 4);
+}
+
+
+/*crc32c_init builds the fallback table and picks the SSE4.2 kernel when the CPU supports it.
+  Called once from main before any thread starts*/
+#ifdef HAVE_X86_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c = crc, v;
+
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	return c;
+}
+#endif
+
+void crc32c_init(void) {
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		}
+		crc32c_tab[i] = c;
+	}
+	crc32c_kernel = crc32c_table;
+#ifdef HAVE_X86_CRC
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_kernel = crc32c_sse42;
+	}
+#endif
+}
+
+
+/*crc32c continues a CRC32C: start with 0 and feed the data in order*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	return ~crc32c_kernel(~crc, buf, len);
+}
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+	while (len-- > 0) {
+		crc = crc32c_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+
+/*send_compressed reads BLOCKSIZE pieces of the range and sends each as a block, compressed if
+  worth_compressing says so and the result is actually smaller. Returns the file bytes sent*/
+off_t send_compressed(int sock, int fd, off_t offset, off_t size, int level, off_t *wire, uint32_t *crc) {
+	unsigned char *raw, *out;
+	uLongf stored;
+	uint32_t v;
+	off_t sent = 0;
+	ssize_t n;
+
+	if (crc != NULL) {
+		*crc = 0;
+	}
+	raw = malloc(BLOCKSIZE);
+	out = malloc(BLOCKHEADER + compressBound(BLOCKSIZE));
+	if (raw == NULL || out == NULL) {
+		printf("ERROR: Out of memory\n");
+		exit(1);
+	}
+	while (sent < size) {
+		n = pread(fd, raw, (size - sent) < BLOCKSIZE ? (size - sent) : BLOCKSIZE, offset + sent);
+		stat_add(&stats.reads, 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		if (crc != NULL) {
+			*crc = crc32c(*crc, raw, n);
+		}
+		stored = compressBound(BLOCKSIZE);
+		if (worth_compressing(raw, n, level) && compress2(out + BLOCKHEADER, &stored, raw, n, level) == Z_OK && stored < (uLongf)n) {
+			out[0] = 'Z';
+		} else {
+			out[0] = 'R';
+			stored = n;
+			memcpy(out + BLOCKHEADER, raw, n);
+		}
+		v = htonl(n);
+		memcpy(out + 1, &v, 4);
+		v = htonl(stored);
+		memcpy(out + 5, &v, 4);
+		if (write_all(sock, out, BLOCKHEADER + stored) != 0) {
+			perror("ERROR: write failed");
+			break;
+		}
+		*wire += BLOCKHEADER + stored;
+		sent += n;
+	}
+	free(raw);
+	free(out);
+	return sent;
+}
+
+
+/*worth_compressing compresses a SAMPLESIZE slice from the middle of the block at the same level
+  and says whether it shrank below SAMPLERATIO percent. Already compressed data (media, archives)
+  fails this and costs one small deflate per block instead of a full one*/
+int worth_compressing(const unsigned char *block, size_t len, int level) {
+	unsigned char out[SAMPLESIZE + 64];
+	uLongf stored = sizeof(out);
+	size_t start = 0, n = len;
+
+	if (len > SAMPLESIZE) {
+		start = (len - SAMPLESIZE) / 2;
+		n = SAMPLESIZE;
+	}
+	if (compress2(out, &stored, block + start, n, level) != Z_OK) {
+		return 0;
+	}
+	return stored * 100 < n * SAMPLERATIO;
+}
+
+
+/*send_file sends size bytes of fd to sock and returns the number sent. sendfile is tried first;
+  if the kernel can't sendfile this pair of descriptors, the rest goes through splice and, failing
+  that, through a large user-space buffer. -b (buffered) skips straight to the buffer copy*/
+off_t send_file(int sock, int fd, off_t offset, off_t size, int buffered) {
+	off_t sent = 0, n;
+
+	if (!buffered) {
+		sent = send_sendfile(sock, fd, offset, size);
+		if (sent < 0) {
+			return -1;
+		}
+		if (sent < size) {
+			n = send_splice(sock, fd, offset + sent, size - sent);
+			if (n < 0) {
+				return -1;
+			}
+			sent += n;
+		}
+	}
+	if (sent < size) {
+		n = send_buffered(sock, fd, offset + sent, size - sent);
+		if (n < 0) {
+			return -1;
+		}
+		sent += n;
+	}
+	return sent;
+}
+
+
+/*send_sendfile sends size bytes of fd from start with sendfile; returns the bytes sent before
+  sendfile gave up as unsupported (EINVAL/ENOSYS), or -1 on a real error. The file position is
+  never used, so several threads can send ranges of the same fd*/
+off_t send_sendfile(int sock, int fd, off_t start, off_t size) {
+	off_t offset = start;
+	off_t end = start + size;
+	ssize_t n;
+
+	while (offset < end) {
+		n = sendfile(sock, fd, &offset, (end - offset) < CHUNK ? (end - offset) : CHUNK);
+		stat_sent(&stats.sendfiles, n);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			break;
+		}
+		if (n < 0) {
+			perror("ERROR: sendfile failed");
+			return -1;
+		}
+		if (n == 0) {
+			break;		/*file shrank under us*/
+		}
+	}
+	return offset - start;
+}
+
+
+/*send_splice moves fd to sock through a pipe with splice, starting at offset; pages are moved by
+  reference, not copied. Returns the bytes sent before splice gave up as unsupported, or -1*/
+off_t send_splice(int sock, int fd, off_t offset, off_t size) {
+	loff_t in = offset;
+	off_t sent = 0;
+	ssize_t n, m;
+	int pipefd[2];
+
+	if (pipe(pipefd) < 0) {
+		return 0;
+	}
+	/*a bigger pipe means fewer splice calls*/
+	fcntl(pipefd[1], F_SETPIPE_SZ, CHUNK);
+
+	while (sent < size) {
+		n = splice(fd, &in, pipefd[1], NULL, (size - sent) < CHUNK ? (size - sent) : CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		stat_add(&stats.splices, 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		/*drain everything that went into the pipe before reading more*/
+		while (n > 0) {
+			m = splice(pipefd[0], NULL, sock, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			stat_sent(&stats.splices, m);
+			if (m < 0 && errno == EINTR) {
+				continue;
+			}
+			if (m <= 0) {
+				perror("ERROR: splice failed");
+				close(pipefd[0]);
+				close(pipefd[1]);
+				return -1;
+			}
+			n -= m;
+			sent += m;
+		}
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return sent;
+}
+
+
+/*read_all reads exactly len bytes; returns 0 on success, -1 on error or early end of stream*/
+int read_all(int fd, void *buf, size_t len) {
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		stat_add(&stats.reads, 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/*put_be64 and get_be64 store and load 64-bit values in network byte order*/
+void put_be64(unsigned char *p, uint64_t v) {
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+uint64_t get_be64(const unsigned char *p) {
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+
+/*name_field fills the fixed-size name field, zero padding short names and cutting long ones*/
+void name_field(char *field, const char *name) {
+	memset(field, 0, NAMELEN);
+	memcpy(field, name, strnlen(name, NAMELEN));
+}
+
+
+/*connect_server opens a TCP connection to addr; returns the socket or -1*/
+int connect_server(struct sockaddr_in *addr) {
+	double t = now();
+	int sock;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("ERROR: Cannot open socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+		perror("ERROR: Connection failed");
+		close(sock);
+		return -1;
+	}
+	stat_phase(PH_CONNECT, t);
+	stat_add(&stats.connections, 1);
+	return sock;
+}
+
+
+/*send_ext_header writes the extended header for one range in a single write*/
+int send_ext_header(int sock, const char *name, int flags, int streams, off_t size, off_t offset, off_t length) {
+	unsigned char hdr[EXT_HEADER];
+
+	build_ext_header(hdr, name, flags, streams, size, offset, length);
+	return write_all(sock, hdr, EXT_HEADER);
+}
+
+/*build_ext_header fills hdr with the extended header and returns its length*/
+int build_ext_header(unsigned char *hdr, const char *name, int flags, int streams, off_t size, off_t offset, off_t length) {
+	unsigned char *p = hdr;
+	uint32_t marker = htonl(EXT_MARKER);
+
+	memcpy(p, &marker, 4);
+	p += 4;
+	*p++ = ' ';
+	name_field((char *)p, name);
+	p += NAMELEN;
+	*p++ = ' ';
+	*p++ = EXT_VERSION;
+	*p++ = flags;
+	*p++ = (streams >> 8) & 0xff;
+	*p++ = streams & 0xff;
+	put_be64(p, size);
+	put_be64(p + 8, offset);
+	put_be64(p + 16, length);
+	return EXT_HEADER;
+}
+
+
+/*send_parallel splits the file into streams ranges and sends each over its own connection.
+  Ranges are rounded to RANGEALIGN so the receiver's pwrites stay page aligned. Returns 0 if
+  every range was acknowledged with code 0*/
+int send_parallel(struct sockaddr_in *addr, const char *name, int fd, off_t size, int streams, int buffered, int level, int check) {
+	struct range_job jobs[MAXSTREAMS];
+	pthread_t threads[MAXSTREAMS];
+	off_t chunk, offset = 0, received = 0, wire = 0;
+	int i, started, status = 0;
+
+	chunk = (size + streams - 1) / streams;
+	chunk = (chunk + RANGEALIGN - 1) / RANGEALIGN * RANGEALIGN;
+	if (chunk == 0) {
+		chunk = RANGEALIGN;
+	}
+	/*small files may need fewer ranges than asked for; always send at least one*/
+	for (started = 0; started < streams && (offset < size || started == 0); started++) {
+		jobs[started].addr = addr;
+		jobs[started].fd = fd;
+		jobs[started].name = name;
+		jobs[started].size = size;
+		jobs[started].offset = offset;
+		jobs[started].length = (size - offset) < chunk ? (size - offset) : chunk;
+		jobs[started].buffered = buffered;
+		jobs[started].level = level;
+		jobs[started].check = check;
+		jobs[started].wire = 0;
+		jobs[started].code = -1;
+		jobs[started].received = 0;
+		offset += jobs[started].length;
+	}
+	for (i = 0; i < started; i++) {
+		jobs[i].streams = started;
+		if (pthread_create(&threads[i], NULL, range_worker, &jobs[i]) != 0) {
+			printf("ERROR: Cannot start thread\n");
+			exit(1);
+		}
+	}
+	printf("Sending %lld bytes over %d connection(s)...\n", (long long)size, started);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+		printf("Range %d [%lld, %lld): returned code %d, returned size %lld\n", i, (long long)jobs[i].offset, (long long)(jobs[i].offset + jobs[i].length), jobs[i].code, (long long)jobs[i].received);
+		if (jobs[i].code != 0) {
+			status = 1;
+		}
+		received += jobs[i].received;
+		wire += jobs[i].wire;
+	}
+	if (level) {
+		printf("Compressed %lld bytes to %lld\n", (long long)size, (long long)wire);
+	}
+	printf("Returned file size: %lld\n", (long long)received);
+	printf("Transfer %s.\n", status ? "failed" : "complete");
+	return status;
+}
+
+
+/*range_worker sends one range: connect, extended header, data, then read the reply*/
+void *range_worker(void *arg) {
+	struct range_job *job = arg;
+	unsigned char reply[4 + 1 + 8];
+	uint32_t code, crc;
+	int sock, flags;
+	double t;
+
+	if ((sock = connect_server(job->addr)) < 0) {
+		return NULL;
+	}
+	t = now();
+	flags = (job->level ? FLAG_COMPRESS : 0) | (job->check ? FLAG_CRC : 0);
+	if (send_ext_header(sock, job->name, flags, job->streams, job->size, job->offset, job->length) != 0) {
+		perror("ERROR: header write failed");
+		close(sock);
+		return NULL;
+	}
+	stat_phase(PH_HEADER, t);
+	t = now();
+	if (send_data(sock, job->fd, job->offset, job->length, job->buffered, job->level, &job->wire, job->check ? &crc : NULL) != job->length) {
+		close(sock);
+		return NULL;
+	}
+	if (job->check && send_trailer(sock, crc) != 0) {
+		perror("ERROR: write failed");
+		close(sock);
+		return NULL;
+	}
+	stat_phase(PH_DATA, t);
+	t = now();
+	if (read_all(sock, reply, sizeof(reply)) != 0) {
+		printf("ERROR: wrong number bytes read\n");
+		close(sock);
+		return NULL;
+	}
+	stat_phase(PH_REPLY, t);
+	memcpy(&code, reply, 4);
+	job->code = ntohl(code);
+	job->received = get_be64(reply + 5);
+	close(sock);
+	return NULL;
+}
+
+
+/*send_delta runs a delta transfer over one connection: extended header with FLAG_DELTA, read
+  the server's block signatures, send tokens and read the reply, whose size is the number of
+  bytes the tokens took. Returns 0 if the server answered with code 0*/
+int send_delta(struct sockaddr_in *addr, const char *name, int fd, off_t size, int check) {
+	unsigned char head[4 + 4 + 8], reply[4 + 1 + 8];
+	unsigned char *sigbuf = NULL, *data = NULL;
+	struct block_sig *sigs = NULL;
+	uint32_t block, count, code, crc = 0;
+	off_t oldsize, shipped;
+	int sock, i;
+	double t;
+
+	if ((sock = connect_server(addr)) < 0) {
+		return 1;
+	}
+	printf("Connected.\n");
+	t = now();
+	if (send_ext_header(sock, name, FLAG_DELTA | (check ? FLAG_CRC : 0), 1, size, 0, size) != 0 || read_all(sock, head, sizeof(head)) != 0) {
+		printf("ERROR: delta handshake failed\n");
+		exit(1);
+	}
+	memcpy(&block, head, 4);
+	memcpy(&count, head + 4, 4);
+	block = ntohl(block);
+	count = ntohl(count);
+	oldsize = get_be64(head + 8);
+	if (count > 0 && (block == 0 || (uint64_t)count != ((uint64_t)oldsize + block - 1) / block)) {
+		printf("ERROR: malformed block signatures\n");
+		exit(1);
+	}
+	printf("Server has %lld bytes in %u blocks of %u\n", (long long)oldsize, count, block);
+
+	if (count > 0) {
+		sigbuf = malloc((size_t)count * SIGSIZE);
+		sigs = malloc((size_t)count * sizeof(*sigs));
+		if (sigbuf == NULL || sigs == NULL) {
+			printf("ERROR: Out of memory\n");
+			exit(1);
+		}
+		if (read_all(sock, sigbuf, (size_t)count * SIGSIZE) != 0) {
+			printf("ERROR: wrong number bytes read\n");
+			exit(1);
+		}
+		for (i = 0; i < (int)count; i++) {
+			memcpy(&sigs[i].weak, sigbuf + (size_t)i * SIGSIZE, 4);
+			sigs[i].weak = ntohl(sigs[i].weak);
+			memcpy(sigs[i].strong, sigbuf + (size_t)i * SIGSIZE + 4, 16);
+		}
+		free(sigbuf);
+	}
+	stat_phase(PH_HEADER, t);
+
+	t = now();
+	if (size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			perror("ERROR: Cannot map the input file");
+			exit(1);
+		}
+		madvise(data, size, MADV_SEQUENTIAL);
+	}
+	shipped = delta_tokens(sock, data, size, sigs, count, block, oldsize, check ? &crc : NULL);
+	if (shipped < 0 || (check && send_trailer(sock, crc) != 0)) {
+		perror("ERROR: write failed");
+		exit(1);
+	}
+	if (size > 0) {
+		munmap(data, size);
+	}
+	free(sigs);
+	stat_phase(PH_DATA, t);
+
+	/*print status*/
+	printf("File Sent.\n");
+	t = now();
+	if (read_all(sock, reply, sizeof(reply)) != 0) {
+		printf("ERROR: wrong number bytes read\n");
+		exit(1);
+	}
+	stat_phase(PH_REPLY, t);
+	memcpy(&code, reply, 4);
+	code = ntohl(code);
+	printf("Returned code: %u\n", code);
+	printf("Returned size (bytes shipped): %llu of %lld\n", (unsigned long long)get_be64(reply + 5), (long long)size);
+	close(sock);
+	printf("Transfer complete. Socket closed.\n");
+	return code != 0;
+}
+
+
+/*delta_tokens slides a block-sized window over data with a rolling checksum. Where the weak sum
+  and then the strong hash match one of the server's blocks, the pending literal bytes and a
+  block reference are sent and the window jumps past the block; otherwise it moves one byte.
+  The server's last block may be short, so it is only tried against the end of the file.
+  If crc is not NULL, the CRC32C of the file is updated as each literal run or matched block
+  is passed. Returns the bytes written to the socket or -1*/
+off_t delta_tokens(int sock, const unsigned char *data, off_t size, struct block_sig *sigs, int count, uint32_t block, off_t oldsize, uint32_t *crc) {
+	struct token_writer *tw;
+	unsigned char strong[16], tok[5];
+	uint32_t a = 0, b = 0, v;
+	int *buckets = NULL, bits = 1, i, match;
+	off_t pos = 0, lit = 0, lastlen, shipped;
+
+	if ((tw = malloc(sizeof(*tw))) == NULL) {
+		return -1;
+	}
+	tw->sock = sock;
+	tw->len = 0;
+	tw->shipped = 0;
+
+	/*hash table of weak sums, 2 buckets per block; the low half of the weak sum is a plain byte
+	  sum and clusters badly, so buckets come from a multiplicative hash of the whole value*/
+	while ((1 << bits) < 2 * count) {
+		bits++;
+	}
+	if (count > 0) {
+		if ((buckets = malloc(sizeof(int) << bits)) == NULL) {
+			free(tw);
+			return -1;
+		}
+		memset(buckets, -1, sizeof(int) << bits);
+		for (i = count - 1; i >= 0; i--) {
+			sigs[i].next = buckets[BUCKET(sigs[i].weak, bits)];
+			buckets[BUCKET(sigs[i].weak, bits)] = i;
+		}
+	}
+	lastlen = oldsize - (off_t)(count - 1) * block;
+
+	if (count > 0 && size >= (off_t)block) {
+		v = weak_sum(data, block);
+		a = v & 0xffff;
+		b = v >> 16;
+	}
+	while (pos < size) {
+		match = -1;
+		if (count > 0 && pos + (off_t)block <= size) {
+			v = (a & 0xffff) | (b << 16);
+			for (i = buckets[BUCKET(v, bits)]; i >= 0; i = sigs[i].next) {
+				if (sigs[i].weak != v || (i == count - 1 && lastlen != block)) {
+					continue;
+				}
+				if (match == -1) {
+					strong_sum(data + pos, block, strong);
+					match = -2;
+				}
+				if (memcmp(strong, sigs[i].strong, 16) == 0) {
+					match = i;
+					break;
+				}
+			}
+		} else if (count > 0 && size - pos == lastlen && weak_sum(data + pos, lastlen) == sigs[count - 1].weak) {
+			strong_sum(data + pos, lastlen, strong);
+			if (memcmp(strong, sigs[count - 1].strong, 16) == 0) {
+				match = count - 1;
+			}
+		}
+
+		if (match >= 0) {
+			/*flush the literal run, then reference the block*/
+			while (lit < pos) {
+				off_t n = (pos - lit) < MAXLITERAL ? (pos - lit) : MAXLITERAL;
+				tok[0] = 'L';
+				v = htonl(n);
+				memcpy(tok + 1, &v, 4);
+				if (token_put(tw, tok, 5) != 0 || token_put(tw, data + lit, n) != 0) {
+					goto fail;
+				}
+				if (crc != NULL) {
+					*crc = crc32c(*crc, data + lit, n);
+				}
+				lit += n;
+			}
+			tok[0] = 'B';
+			v = htonl(match);
+			memcpy(tok + 1, &v, 4);
+			if (token_put(tw, tok, 5) != 0) {
+				goto fail;
+			}
+			if (crc != NULL) {
+				*crc = crc32c(*crc, data + pos, (match == count - 1) ? lastlen : block);
+			}
+			pos += (match == count - 1) ? lastlen : block;
+			lit = pos;
+			if (pos + (off_t)block <= size) {
+				v = weak_sum(data + pos, block);
+				a = v & 0xffff;
+				b = v >> 16;
+			}
+			continue;
+		}
+
+		/*roll the window one byte*/
+		if (count > 0 && pos + (off_t)block < size) {
+			a = (a - data[pos] + data[pos + block]) & 0xffff;
+			b = (b - block * data[pos] + a) & 0xffff;
+		}
+		pos++;
+		/*keep literal tokens bounded*/
+		if (pos - lit == MAXLITERAL) {
+			tok[0] = 'L';
+			v = htonl(MAXLITERAL);
+			memcpy(tok + 1, &v, 4);
+			if (token_put(tw, tok, 5) != 0 || token_put(tw, data + lit, MAXLITERAL) != 0) {
+				goto fail;
+			}
+			if (crc != NULL) {
+				*crc = crc32c(*crc, data + lit, MAXLITERAL);
+			}
+			lit = pos;
+		}
+	}
+	if (lit < pos) {
+		tok[0] = 'L';
+		v = htonl(pos - lit);
+		memcpy(tok + 1, &v, 4);
+		if (token_put(tw, tok, 5) != 0 || token_put(tw, data + lit, pos - lit) != 0) {
+			goto fail;
+		}
+		if (crc != NULL) {
+			*crc = crc32c(*crc, data + lit, pos - lit);
+		}
+	}
+	tok[0] = 'E';
+	if (token_put(tw, tok, 1) != 0 || token_flush(tw) != 0) {
+		goto fail;
+	}
+	shipped = tw->shipped;
+	free(buckets);
+	free(tw);
+	return shipped;
+
+fail:
+	free(buckets);
+	free(tw);
+	return -1;
+}
+
+
+/*token_put appends to the token buffer; data that does not fit is written straight through*/
+int token_put(struct token_writer *tw, const void *buf, size_t len) {
+	if (len >= TOKENBUFFER) {
+		if (token_flush(tw) != 0) {
+			return -1;
+		}
+		tw->shipped += len;
+		return write_all(tw->sock, buf, len);
+	}
+	if (tw->len + len > TOKENBUFFER && token_flush(tw) != 0) {
+		return -1;
+	}
+	memcpy(tw->buf + tw->len, buf, len);
+	tw->len += len;
+	return 0;
+}
+
+int token_flush(struct token_writer *tw) {
+	if (tw->len > 0 && write_all(tw->sock, tw->buf, tw->len) != 0) {
+		return -1;
+	}
+	tw->shipped += tw->len;
+	tw->len = 0;
+	return 0;
+}
+
+
+/*weak_sum is the rsync rolling checksum: a = sum of bytes, b = sum of (len - i) * byte, each
+  mod 2^16, packed as a | b << 16*/
+uint32_t weak_sum(const unsigned char *p, size_t len) {
+	uint32_t a = 0, b = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		a += p[i];
+		b += (uint32_t)(len - i) * p[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+
+/*strong_sum is MurmurHash3 x64 128 with seed 0; it only has to make a weak sum collision on a
+  wrong block vanishingly unlikely, not resist attack*/
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+void strong_sum(const unsigned char *p, size_t len, unsigned char out[16]) {
+	const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+	size_t i, rem, nblocks = len / 16;
+	const unsigned char *tail = p + nblocks * 16;
+
+	for (i = 0; i < nblocks; i++) {
+		memcpy(&k1, p + i * 16, 8);
+		memcpy(&k2, p + i * 16 + 8, 8);
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+	k1 = 0;
+	k2 = 0;
+	rem = len & 15;
+	for (i = rem; i > 8; i--) {
+		k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+	}
+	for (i = (rem > 8 ? 8 : rem); i > 0; i--) {
+		k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+	}
+	if (rem > 8) {
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+	}
+	if (rem > 0) {
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	memcpy(out, &h1, 8);
+	memcpy(out + 8, &h2, 8);
+}
+
+
+/*send_multi streams count files over one connection. The socket is corked so frame headers and
+  small files are packed into full segments, and acks are read without blocking after every
+  file so the server never stalls on a full send buffer. Returns 0 if every file was acked
+  with code 0*/
+int send_multi(struct sockaddr_in *addr, char **files, int count, int buffered, int level, int check) {
+	struct ack_reader *ar;
+	struct stat st;
+	unsigned char frame[2 + MAXNAME + 8], reply[4 + 1 + 8];
+	off_t total = 0, wire = 0;
+	size_t len;
+	uint32_t code, crc;
+	int sock, fd, i, one = 1, zero = 0;
+	double t;
+
+	/*check every file first so the stream is never cut short*/
+	for (i = 0; i < count; i++) {
+		if (stat(files[i], &st) != 0 || !S_ISREG(st.st_mode)) {
+			printf("ERROR: Cannot open the input file %s\n", files[i]);
+			exit(0);
+		}
+		if (strlen(files[i]) >= MAXNAME) {
+			printf("ERROR: file name too long: %s\n", files[i]);
+			exit(1);
+		}
+		total += st.st_size;
+	}
+	if ((ar = calloc(1, sizeof(*ar))) == NULL) {
+		printf("ERROR: Out of memory\n");
+		exit(1);
+	}
+	ar->files = files;
+	ar->count = count;
+
+	if ((sock = connect_server(addr)) < 0) {
+		exit(1);
+	}
+	printf("Connected.\n");
+	t = now();
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+	if (send_ext_header(sock, "", FLAG_MULTI | (level ? FLAG_COMPRESS : 0) | (check ? FLAG_CRC : 0), 1, total, 0, total) != 0) {
+		perror("ERROR: header write failed");
+		exit(1);
+	}
+	stat_phase(PH_HEADER, t);
+
+	/*acks that arrive while frames are still going out count as data time*/
+	t = now();
+
+	for (i = 0; i < count; i++) {
+		if ((fd = open(files[i], O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+			printf("ERROR: Cannot open the input file %s\n", files[i]);
+			exit(1);
+		}
+		len = strlen(files[i]);
+		frame[0] = (len >> 8) & 0xff;
+		frame[1] = len & 0xff;
+		memcpy(frame + 2, files[i], len);
+		put_be64(frame + 2 + len, st.st_size);
+		if (write_all(sock, frame, 2 + len + 8) != 0 || send_data(sock, fd, 0, st.st_size, buffered, level, &wire, check ? &crc : NULL) != st.st_size || (check && send_trailer(sock, crc) != 0)) {
+			printf("ERROR: sending %s failed\n", files[i]);
+			exit(1);
+		}
+		close(fd);
+		if (read_acks(sock, ar, 0) != 0) {
+			exit(1);
+		}
+	}
+	frame[0] = 0;
+	frame[1] = 0;
+	if (write_all(sock, frame, 2) != 0) {
+		perror("ERROR: write failed");
+		exit(1);
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+	stat_phase(PH_DATA, t);
+	printf("%d files sent (%lld bytes).\n", count, (long long)total);
+	if (level) {
+		printf("Compressed %lld bytes to %lld\n", (long long)total, (long long)wire);
+	}
+
+	/*collect the acks still in flight, then the final reply*/
+	t = now();
+	while (ar->acked < count) {
+		if (read_acks(sock, ar, 1) != 0) {
+			exit(1);
+		}
+	}
+	if (ar->have > 0) {
+		memcpy(reply, ar->buf, ar->have);
+	}
+	if (ar->have > sizeof(reply) || read_all(sock, reply + ar->have, sizeof(reply) - ar->have) != 0) {
+		printf("ERROR: wrong number bytes read\n");
+		exit(1);
+	}
+	stat_phase(PH_REPLY, t);
+	memcpy(&code, reply, 4);
+	code = ntohl(code);
+	printf("Returned code: %u\n", code);
+	printf("Returned size: %llu\n", (unsigned long long)get_be64(reply + 5));
+	printf("%d of %d files acknowledged OK.\n", ar->acked - ar->failed, count);
+	close(sock);
+	printf("Transfer complete. Socket closed.\n");
+	code = (code != 0 || ar->failed > 0);
+	free(ar);
+	return code;
+}
+
+
+/*read_acks reads whatever acks have arrived (waiting for at least one byte if wait is set) and
+  reports failed files. Bytes after the last expected ack belong to the final reply and are
+  left in the buffer. Returns -1 if the connection broke*/
+int read_acks(int sock, struct ack_reader *ar, int wait) {
+	unsigned char *p;
+	uint32_t index, code;
+	ssize_t n;
+
+	n = recv(sock, ar->buf + ar->have, sizeof(ar->buf) - ar->have, wait ? 0 : MSG_DONTWAIT);
+	stat_add(&stats.reads, 1);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return 0;
+	}
+	if (n <= 0) {
+		printf("ERROR: connection closed before all files were acknowledged\n");
+		return -1;
+	}
+	ar->have += n;
+	for (p = ar->buf; ar->have >= ACKSIZE && ar->acked < ar->count; p += ACKSIZE, ar->have -= ACKSIZE) {
+		memcpy(&index, p, 4);
+		memcpy(&code, p + 4, 4);
+		index = ntohl(index);
+		code = ntohl(code);
+		if (index >= (uint32_t)ar->count) {
+			printf("ERROR: malformed acknowledgement\n");
+			return -1;
+		}
+		if (code != 0) {
+			printf("ERROR: %s returned code %u\n", ar->files[index], code);
+			ar->failed++;
+		}
+		ar->acked++;
+	}
+	memmove(ar->buf, p, ar->have);
+	return 0;
+}
+
+
+/*run_engine uploads every job in jobfile from one thread. Each upload is a small state machine
+  (connect, send header and data, read the reply) on a non-blocking socket watched by epoll.
+  At most conns uploads are in progress; each refills its ENGINEBUFFER buffer from the file
+  only while the bytes buffered across all uploads stay within budget, and uploads that find
+  the budget used up wait, off epoll, until another upload drains its buffer. Returns 0 if
+  every upload got code 0*/
+int run_engine(const char *jobfile, int conns, off_t budget) {
+	struct epoll_event events[ENGINEEVENTS];
+	struct upload *jobs, *u, *waiting = NULL;
+	struct hostent *server;
+	char line[4096 + 64], host[256], path[4096];
+	FILE *list;
+	int ep, count = 0, next = 0, active = 0, done = 0, failed = 0, i, j, n;
+	double start = now();
+	off_t total = 0;
+
+	if ((list = fopen(jobfile, "r")) == NULL) {
+		printf("ERROR: Cannot open the job file %s\n", jobfile);
+		exit(1);
+	}
+	if ((jobs = calloc(MAXJOBS, sizeof(*jobs))) == NULL) {
+		printf("ERROR: Out of memory\n");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), list) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%255s %d %4095s", host, &n, path) != 3) {
+			continue;
+		}
+		if (count == MAXJOBS) {
+			printf("ERROR: more than %d jobs\n", MAXJOBS);
+			exit(1);
+		}
+		jobs[count].host = strdup(host);
+		jobs[count].port = n;
+		jobs[count].path = strdup(path);
+		jobs[count].fd = -1;
+		jobs[count].sock = -1;
+		jobs[count].code = -1;
+		count++;
+	}
+	fclose(list);
+
+	/*look every host up now: gethostbyname blocks, and inside the loop it would stall every
+	  upload in progress. Jobs for a host seen before reuse its address*/
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < i && strcmp(jobs[j].host, jobs[i].host) != 0; j++)
+			;
+		if (j < i) {
+			jobs[i].addr = jobs[j].addr;
+		} else if ((server = gethostbyname(jobs[i].host)) != NULL) {
+			jobs[i].addr.sin_family = AF_INET;
+			memcpy(&jobs[i].addr.sin_addr.s_addr, server->h_addr, server->h_length);
+		}
+		jobs[i].addr.sin_port = htons(jobs[i].port);
+	}
+
+	if ((ep = epoll_create1(0)) < 0) {
+		perror("ERROR: epoll_create1 failed");
+		exit(1);
+	}
+	printf("Uploading %d files, %d at a time, %lld MB buffer budget...\n", count, conns, (long long)(budget >> 20));
+
+	while (done < count) {
+		while (active < conns && next < count) {
+			if (engine_start(ep, &jobs[next], &budget, &waiting) == 0) {
+				active++;
+			} else {
+				done++;
+				failed++;
+			}
+			next++;
+		}
+		if (active == 0) {
+			continue;
+		}
+		n = epoll_wait(ep, events, ENGINEEVENTS, -1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			perror("ERROR: epoll_wait failed");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			u = events[i].data.ptr;
+			if (u->state == UP_DONE || engine_step(ep, u, &budget, &waiting) == 0) {
+				continue;
+			}
+			/*the upload finished, one way or the other*/
+			active--;
+			done++;
+			total += u->received;
+			if (u->code != 0) {
+				failed++;
+			}
+		}
+	}
+	close(ep);
+	printf("%d of %d uploads OK, %lld bytes in %.3f s\n", count - failed, count, (long long)total, now() - start);
+	for (i = 0; i < count; i++) {
+		free(jobs[i].host);
+		free(jobs[i].path);
+	}
+	free(jobs);
+	return failed > 0;
+}
+
+
+/*engine_start opens the file, builds the header and begins a non-blocking connect*/
+int engine_start(int ep, struct upload *u, off_t *budget, struct upload **waiting) {
+	struct epoll_event ev;
+	struct stat st;
+	uint32_t netsize;
+	int len;
+
+	u->start = now();
+	if ((u->fd = open(u->path, O_RDONLY)) < 0 || fstat(u->fd, &st) != 0) {
+		printf("%s: ERROR: Cannot open the input file\n", u->path);
+		engine_finish(ep, u, -1, budget, waiting);
+		return -1;
+	}
+	if (u->addr.sin_family != AF_INET) {
+		printf("%s: ERROR: unknown host %s\n", u->path, u->host);
+		engine_finish(ep, u, -1, budget, waiting);
+		return -1;
+	}
+	u->size = st.st_size;
+	u->extended = (u->size > INT32_MAX);
+	if ((u->buf = malloc(ENGINEBUFFER)) == NULL) {
+		printf("ERROR: Out of memory\n");
+		exit(1);
+	}
+	/*the header goes out of the same buffer as the data*/
+	if (u->extended) {
+		len = build_ext_header(u->buf, u->path, 0, 1, u->size, 0, u->size);
+	} else {
+		netsize = htonl(u->size);
+		memcpy(u->buf, &netsize, 4);
+		u->buf[4] = ' ';
+		name_field((char *)u->buf + 5, u->path);
+		u->buf[5 + NAMELEN] = ' ';
+		len = 4 + 1 + NAMELEN + 1;
+	}
+	u->head = 0;
+	u->tail = len;
+
+	if ((u->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("ERROR: Cannot open socket");
+		engine_finish(ep, u, -1, budget, waiting);
+		return -1;
+	}
+	if (connect(u->sock, (struct sockaddr *)&u->addr, sizeof(u->addr)) < 0 && errno != EINPROGRESS) {
+		printf("%s: ERROR: Connection to %s:%d failed: %s\n", u->path, u->host, u->port, strerror(errno));
+		engine_finish(ep, u, -1, budget, waiting);
+		return -1;
+	}
+	u->state = UP_CONNECTING;
+	ev.events = EPOLLOUT;
+	ev.data.ptr = u;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, u->sock, &ev) != 0) {
+		perror("ERROR: epoll_ctl failed");
+		exit(1);
+	}
+	return 0;
+}
+
+
+/*engine_step advances an upload as far as its socket allows. Returns 1 once it is finished*/
+int engine_step(int ep, struct upload *u, off_t *budget, struct upload **waiting) {
+	struct epoll_event ev;
+	uint32_t code;
+	socklen_t len = sizeof(int);
+	ssize_t n;
+	size_t want;
+	int err = 0;
+
+	if (u->state == UP_CONNECTING) {
+		if (getsockopt(u->sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+			printf("%s: ERROR: Connection to %s:%d failed: %s\n", u->path, u->host, u->port, strerror(err));
+			engine_finish(ep, u, -1, budget, waiting);
+			return 1;
+		}
+		u->state = UP_SENDING;
+	}
+
+	while (u->state == UP_SENDING || u->state == UP_WAITING) {
+		if (u->head == u->tail) {
+			/*buffer drained: give its bytes back*/
+			engine_release(ep, u, budget, waiting);
+			if (u->readpos == u->size) {
+				u->state = UP_REPLY;
+				u->replylen = 0;
+				ev.events = EPOLLIN;
+				ev.data.ptr = u;
+				epoll_ctl(ep, EPOLL_CTL_MOD, u->sock, &ev);
+				break;
+			}
+			want = ENGINEBUFFER;
+			if ((off_t)want > u->size - u->readpos) {
+				want = u->size - u->readpos;
+			}
+			if ((off_t)want > *budget) {
+				want = *budget;
+			}
+			if (want == 0) {
+				/*park off epoll (even EPOLLHUP would wake a parked socket) until
+				  another upload frees some budget*/
+				u->state = UP_WAITING;
+				u->next = *waiting;
+				*waiting = u;
+				epoll_ctl(ep, EPOLL_CTL_DEL, u->sock, NULL);
+				return 0;
+			}
+			n = pread(u->fd, u->buf, want, u->readpos);
+			if (n <= 0) {
+				printf("%s: ERROR: read failed\n", u->path);
+				engine_finish(ep, u, -1, budget, waiting);
+				return 1;
+			}
+			u->head = 0;
+			u->tail = n;
+			u->readpos += n;
+			u->charged = n;
+			*budget -= n;
+			u->state = UP_SENDING;
+		}
+		n = write(u->sock, u->buf + u->head, u->tail - u->head);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			printf("%s: ERROR: write failed: %s\n", u->path, strerror(errno));
+			engine_finish(ep, u, -1, budget, waiting);
+			return 1;
+		}
+		u->head += n;
+	}
+
+	if (u->state == UP_REPLY) {
+		len = u->extended ? 4 + 1 + 8 : 4 + 1 + 4;
+		while (u->replylen < len) {
+			n = read(u->sock, u->reply + u->replylen, len - u->replylen);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				printf("%s: ERROR: wrong number bytes read\n", u->path);
+				engine_finish(ep, u, -1, budget, waiting);
+				return 1;
+			}
+			u->replylen += n;
+		}
+		memcpy(&code, u->reply, 4);
+		if (u->extended) {
+			u->received = get_be64(u->reply + 5);
+		} else {
+			memcpy(&err, u->reply + 5, 4);
+			u->received = ntohl(err);
+		}
+		engine_finish(ep, u, ntohl(code), budget, waiting);
+		printf("%s -> %s:%d: returned code %d, returned size %lld, %.3f s\n", u->path, u->host, u->port, u->code, (long long)u->received, now() - u->start);
+		return 1;
+	}
+	return 0;
+}
+
+
+/*engine_release gives the bytes u holds back to the budget and, if that freed any, wakes every
+  upload waiting for budget. Every path that frees buffered bytes goes through here, so a
+  parked upload is never left off epoll with budget to spare*/
+void engine_release(int ep, struct upload *u, off_t *budget, struct upload **waiting) {
+	struct epoll_event ev;
+	struct upload *w;
+
+	if (u->charged == 0) {
+		return;
+	}
+	*budget += u->charged;
+	u->charged = 0;
+	while (*waiting != NULL) {
+		w = *waiting;
+		*waiting = w->next;
+		w->state = UP_SENDING;
+		ev.events = EPOLLOUT;
+		ev.data.ptr = w;
+		epoll_ctl(ep, EPOLL_CTL_ADD, w->sock, &ev);
+	}
+}
+
+
+/*engine_finish records the result, returns any budget the upload held and releases its
+  socket, file and buffer*/
+void engine_finish(int ep, struct upload *u, int code, off_t *budget, struct upload **waiting) {
+	engine_release(ep, u, budget, waiting);
+	u->code = code;
+	u->state = UP_DONE;
+	if (u->sock >= 0) {
+		epoll_ctl(ep, EPOLL_CTL_DEL, u->sock, NULL);
+		close(u->sock);
+		u->sock = -1;
+	}
+	if (u->fd >= 0) {
+		close(u->fd);
+		u->fd = -1;
+	}
+	free(u->buf);
+	u->buf = NULL;
+}
+
+
+/*now returns a monotonic time in seconds*/
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*stat_add bumps one -S counter; relaxed is enough as they are only read after the threads join*/
+void stat_add(uint64_t *counter, uint64_t n) {
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/*stat_phase charges the time since since to phase*/
+void stat_phase(int phase, double since) {
+	stat_add(&stats.phase_us[phase], (uint64_t)((now() - since) * 1e6));
+}
+
+/*stat_sent counts one call that wrote n bytes to the socket, or failed if n < 0*/
+void stat_sent(uint64_t *counter, ssize_t n) {
+	stat_add(counter, 1);
+	if (n > 0) {
+		stat_add(&stats.sockwrites, 1);
+		stat_add(&stats.wire, n);
+	}
+}
+
+
+/*stats_report prints the -S line: what was sent, how long each phase took, throughput of the
+  file bytes over the whole run, and how many syscalls moved them. Multi-connection phase times
+  are summed over the connections, so they can add up to more than total_s*/
+void stats_report(const char *mode, char **files, int count, off_t size, int status, double start) {
+	struct stat st;
+	double total = now() - start;
+	int i;
+
+	if (!show_stats) {
+		return;
+	}
+	if (size < 0) {
+		for (i = 0, size = 0; i < count; i++) {
+			if (stat(files[i], &st) == 0) {
+				size += st.st_size;
+			}
+		}
+	}
+	printf("{\"mode\":\"%s\",\"file\":", mode);
+	json_string(files[0]);
+	printf(",\"files\":%d,\"size\":%lld,\"status\":%d,\"connections\":%llu", count, (long long)size, status, (unsigned long long)stats.connections);
+	printf(",\"resolve_s\":%.6f,\"connect_s\":%.6f,\"header_s\":%.6f,\"data_s\":%.6f,\"reply_s\":%.6f,\"total_s\":%.6f",
+		stats.phase_us[PH_RESOLVE] / 1e6, stats.phase_us[PH_CONNECT] / 1e6, stats.phase_us[PH_HEADER] / 1e6,
+		stats.phase_us[PH_DATA] / 1e6, stats.phase_us[PH_REPLY] / 1e6, total);
+	printf(",\"bytes_per_s\":%.0f", total > 0 ? size / total : 0.0);
+	printf(",\"syscalls\":{\"write\":%llu,\"sendfile\":%llu,\"splice\":%llu,\"read\":%llu}",
+		(unsigned long long)stats.writes, (unsigned long long)stats.sendfiles, (unsigned long long)stats.splices, (unsigned long long)stats.reads);
+	printf(",\"wire_bytes\":%llu,\"avg_write_bytes\":%.0f}\n", (unsigned long long)stats.wire,
+		stats.sockwrites ? (double)stats.wire / stats.sockwrites : 0.0);
+	fflush(stdout);
+}
+
+/*json_string prints s as a quoted JSON string*/
+void json_string(const char *s) {
+	const unsigned char *p;
+
+	putchar('"');
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			printf("\\%c", *p);
+		} else if (*p < 0x20) {
+			printf("\\u%04x", *p);
+		} else {
+			putchar(*p);
+		}
+	}
+	putchar('"');
+}
+
+
+/*send_buffered is the portable path: pread large chunks into one buffer and write them out*/
+off_t send_buffered(int sock, int fd, off_t offset, off_t size) {
+	char *buff;
+	off_t sent = 0;
+	ssize_t n;
+
+	if ((buff = malloc(CHUNK)) == NULL) {
+		printf("ERROR: Out of memory\n");
+		return -1;
+	}
+	while (sent < size) {
+		n = pread(fd, buff, (size - sent) < CHUNK ? (size - sent) : CHUNK, offset + sent);
+		stat_add(&stats.reads, 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		if (write_all(sock, buff, n) != 0) {
+			perror("ERROR: write failed");
+			free(buff);
+			return -1;
+		}
+		sent += n;
+	}
+	free(buff);
+	return sent;
+}
+
+
+/*usage prints the command format and exits*/
+void usage(void) {
+	printf("Use the format: ftpc [-b] [-c level] [-d] [-k] [-n streams] [-S] <remote-IP> <remote-port> <local-file-to-transfer> \n");
+	printf("               ftpc -p [-b] [-c level] [-k] [-S] <remote-IP> <remote-port> <file> [file...] \n");
+	printf("               ftpc -e <job-file> [-j uploads] [-B budget-MB] \n");
+	printf("  -b  copy through a user-space buffer instead of sendfile/splice\n");
+	printf("  -c  send zlib compressed blocks at this level, 1-9 (needs ftps)\n");
+	printf("  -k  send a CRC32C of the data for the server to verify (needs ftps)\n");
+	printf("  -e  upload every \"host port file\" line of the job file from one event loop\n");
+	printf("  -j  with -e, uploads in progress at once (default %d)\n", ENGINECONNS);
+	printf("  -B  with -e, MB of file data buffered across all uploads (default %d)\n", ENGINEBUDGET);
+	printf("  -d  send only the blocks the server's copy lacks (needs ftps)\n");
+	printf("  -n  split the file into ranges sent over this many connections (needs ftps)\n");
+	printf("  -p  send all the files over one connection with pipelined acks (needs ftps)\n");
+	printf("  -S  print per-phase timings, throughput and syscall counts as one JSON line\n");
+	exit(0);
+}
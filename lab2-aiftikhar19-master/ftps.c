@@ -0,0 +1,891 @@
+/*
+  Filename: ftps.c
+  Synopsis: Reference server for the file transfer protocol spoken by ftpc.
+            Each connection is handled by its own thread and the file is saved as recvd_<name>.
+            Two headers are accepted:
+              legacy:   u32 size, ' ', name[20], ' ', data
+              extended: u32 0xFFFFFFFF, ' ', name[20], ' ', u8 version, u8 flags, u16 streams,
+                        u64 file size, u64 range offset, u64 range length, data
+            The legacy reply is u32 code, ' ', u32 size; the extended reply is u32 code, ' ',
+            u64 size. Ranges of one file may arrive over several connections at once: the file
+            is preallocated to its full size and every range is written in place with pwrite.
+            With the delta flag the server first sends signatures of the blocks of its current
+            copy, then rebuilds the file from the client's literal data and block references.
+            With the multi flag a stream of framed files follows; each is acknowledged as soon as
+            it is stored. With the compress flag the data comes as zlib or raw blocks. With the
+            CRC flag a CRC32C of the data follows it; a mismatch is reported as code 600.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_CRC 1
+#endif
+
+#define CHUNK (1 << 20)		/*receive buffer per connection*/
+#define NAMELEN 20		/*file name field in the header*/
+#define PREFIX "recvd_"		/*prefix for saved files*/
+
+#define EXT_MARKER 0xFFFFFFFFu
+#define EXT_VERSION 1
+#define EXT_FIELDS (1 + 1 + 2 + 8 + 8 + 8)	/*extended header after the name field*/
+#define FLAG_DELTA 0x01		/*delta transfer against the existing copy*/
+
+/*Delta transfer: signatures are u32 block size, u32 block count, u64 size of the current copy,
+  then u32 weak sum and a 16-byte strong hash per block. Tokens from the client are 'L' u32
+  length + data, 'B' u32 block index and 'E'*/
+#define SIGSIZE (4 + 16)
+#define MINBLOCK 2048		/*block size grows with the square root of the file size*/
+#define MAXBLOCK (1 << 17)
+#define PARTSUFFIX ".XXXXXX"	/*mkstemp template: each new copy is built in its own file and renamed over the old one*/
+
+/*Multi-file stream: frames of u16 name length, name, u64 size, data, ended by a zero name
+  length. Each file is acked with u32 index, u32 code, u64 size*/
+#define FLAG_MULTI 0x02
+#define MAXNAME 4096
+#define ACKSIZE (4 + 4 + 8)
+
+/*Compressed data: blocks of u8 type ('Z' zlib or 'R' raw), u32 raw length, u32 stored length,
+  stored bytes*/
+#define FLAG_COMPRESS 0x04
+#define BLOCKSIZE (1 << 18)
+#define BLOCKHEADER (1 + 4 + 4)
+
+/*CRC32C trailer: u32 after the data of a range, of each file in a stream, or after a delta*/
+#define FLAG_CRC 0x08
+#define CRC32C_POLY 0x82F63B78u
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+/*return codes*/
+#define CODE_OK 0
+#define CODE_TOOMANY 100
+#define CODE_CREATE 300
+#define CODE_GENERIC 400
+#define CODE_MALFORMED 500
+#define CODE_CHECKSUM 600
+
+/*Function Declarations*/
+void *handle_client(void *arg);
+int output_name(const char *field, size_t len, char *out, size_t outlen);
+int open_output(const char *path, off_t size, int truncate);
+off_t recv_range(int sock, int fd, off_t offset, off_t length, uint32_t *crc);
+int recv_delta(int sock, const char *path, off_t size, int check, off_t *shipped);
+int recv_multi(int sock, int flags, off_t *total);
+off_t recv_blocks(int sock, int fd, off_t offset, off_t length, uint32_t *crc);
+int check_trailer(int sock, uint32_t crc);
+void crc32c_init(void);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len);
+int send_signatures(int sock, const unsigned char *old, off_t oldsize, uint32_t block);
+uint32_t weak_sum(const unsigned char *p, size_t len);
+void strong_sum(const unsigned char *p, size_t len, unsigned char out[16]);
+int extra_bytes(int sock);
+int send_reply(int sock, int code, off_t size, int extended);
+int write_all(int fd, const void *buf, size_t len);
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset);
+int read_all(int fd, void *buf, size_t len);
+void put_be64(unsigned char *p, uint64_t v);
+uint64_t get_be64(const unsigned char *p);
+
+crc_fn crc32c_kernel;			/*picked once by crc32c_init*/
+uint32_t crc32c_tab[256];
+
+int main(int argc, char *argv[]) {
+
+	/*Variable declarations*/
+	int sock, client, one = 1;		/*listening socket, accepted socket, option value*/
+	struct sockaddr_in serv_addr;		/*address to listen on*/
+	pthread_t thread;			/*thread for each connection*/
+	pthread_attr_t attr;			/*threads are detached*/
+
+	/*Error check input*/
+	if (argc != 2) {
+		printf("ERROR: Incorrect number of arguments.\n");
+		printf("Use the format: ftps <local-port>\n");
+		exit(0);
+	}
+
+	crc32c_init();
+
+	/*Initialize socket*/
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("ERROR: Cannot open socket");
+		exit(1);
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = INADDR_ANY;
+	serv_addr.sin_port = htons(atoi(argv[1]));
+	if (bind(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+		perror("ERROR: Cannot bind socket");
+		exit(1);
+	}
+	if (listen(sock, 64) < 0) {
+		perror("ERROR: Cannot listen");
+		exit(1);
+	}
+
+	/*print status*/
+	printf("Waiting for connections on port %s...\n", argv[1]);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (1) {
+		if ((client = accept(sock, NULL, NULL)) < 0) {
+			if (errno != EINTR) {
+				perror("ERROR: accept failed");
+			}
+			continue;
+		}
+		if (pthread_create(&thread, &attr, handle_client, (void *)(intptr_t)client) != 0) {
+			printf("ERROR: Cannot start thread\n");
+			close(client);
+		}
+	}
+
+return 0;
+}
+
+
+/*handle_client reads one header, stores the data it describes and sends the reply*/
+void *handle_client(void *arg) {
+	int sock = (int)(intptr_t)arg;
+	unsigned char head[4 + 1 + NAMELEN + 1];
+	unsigned char ext[EXT_FIELDS];
+	char path[sizeof(PREFIX) + NAMELEN];
+	uint32_t marker, crc = 0;
+	off_t size, offset, length, got;
+	int fd, extended, code = CODE_OK;
+
+	if (read_all(sock, head, sizeof(head)) != 0) {
+		close(sock);
+		return NULL;
+	}
+	memcpy(&marker, head, 4);
+	marker = ntohl(marker);
+	extended = (marker == EXT_MARKER);
+	if (extended) {
+		if (read_all(sock, ext, sizeof(ext)) != 0) {
+			close(sock);
+			return NULL;
+		}
+		size = get_be64(ext + 4);
+		offset = get_be64(ext + 12);
+		length = get_be64(ext + 20);
+		if (ext[0] != EXT_VERSION || size < 0 || offset < 0 || length < 0 || offset > size || length > size - offset) {
+			send_reply(sock, CODE_MALFORMED, 0, extended);
+			close(sock);
+			return NULL;
+		}
+	} else {
+		size = marker;
+		offset = 0;
+		length = size;
+	}
+	if (head[4] != ' ' || head[4 + 1 + NAMELEN] != ' ') {
+		send_reply(sock, CODE_MALFORMED, 0, extended);
+		close(sock);
+		return NULL;
+	}
+
+	/*a stream of files; the name field is not used*/
+	if (extended && (ext[1] & FLAG_MULTI)) {
+		code = recv_multi(sock, ext[1], &got);
+		send_reply(sock, code, got, extended);
+		close(sock);
+		printf("Received file stream: %lld bytes, code %d\n", (long long)got, code);
+		return NULL;
+	}
+
+	if (output_name((char *)head + 5, NAMELEN, path, sizeof(path)) != 0) {
+		send_reply(sock, CODE_MALFORMED, 0, extended);
+		close(sock);
+		return NULL;
+	}
+
+	/*print status*/
+	printf("Receiving %s: bytes [%lld, %lld) of %lld\n", path, (long long)offset, (long long)(offset + length), (long long)size);
+
+	/*rebuild the file from the client's delta*/
+	if (extended && (ext[1] & FLAG_DELTA)) {
+		code = recv_delta(sock, path, size, ext[1] & FLAG_CRC, &got);
+		send_reply(sock, code, got, extended);
+		close(sock);
+		printf("Received %s by delta: %lld bytes shipped, code %d\n", path, (long long)got, code);
+		return NULL;
+	}
+
+	/*a legacy upload replaces the file; ranges only fill in their part of it*/
+	if ((fd = open_output(path, size, !extended)) < 0) {
+		send_reply(sock, CODE_CREATE, 0, extended);
+		close(sock);
+		return NULL;
+	}
+	if (extended && (ext[1] & FLAG_COMPRESS)) {
+		got = recv_blocks(sock, fd, offset, length, &crc);
+	} else {
+		got = recv_range(sock, fd, offset, length, &crc);
+	}
+	if (got < 0) {
+		code = CODE_GENERIC;
+		got = 0;
+	} else if (got < length) {
+		code = CODE_MALFORMED;
+	} else if (extended && (ext[1] & FLAG_CRC)) {
+		code = check_trailer(sock, crc);
+	}
+	if (code == CODE_OK && extra_bytes(sock)) {
+		code = CODE_TOOMANY;
+	}
+	close(fd);
+	send_reply(sock, code, got, extended);
+	close(sock);
+
+	/*print status*/
+	printf("Received %s: %lld bytes, code %d\n", path, (long long)got, code);
+	return NULL;
+}
+
+
+/*output_name turns a name of up to len bytes into recvd_<basename>; returns -1 if no usable
+  name is left*/
+int output_name(const char *field, size_t len, char *out, size_t outlen) {
+	char name[MAXNAME + 1];
+	char *base;
+
+	if (len > MAXNAME) {
+		return -1;
+	}
+	memcpy(name, field, len);
+	name[len] = '\0';
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	if (base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+		return -1;
+	}
+	snprintf(out, outlen, "%s%s", PREFIX, base);
+	return 0;
+}
+
+
+/*open_output opens path for writing with its full size allocated up front, so concurrent range
+  writers never extend the file and the blocks are laid out in one go*/
+int open_output(const char *path, off_t size, int truncate) {
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644)) < 0) {
+		perror("ERROR: Cannot create file");
+		return -1;
+	}
+	if (size > 0 && fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP) {
+		perror("ERROR: Cannot allocate file");
+		close(fd);
+		return -1;
+	}
+	/*drop anything left over from a larger file of the same name*/
+	if (fstat(fd, &st) == 0 && st.st_size != size && ftruncate(fd, size) != 0) {
+		perror("ERROR: Cannot size file");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/*recv_range reads length bytes from sock and pwrites them at offset; returns the bytes stored
+  (short if the peer closed early) or -1 if the file could not be written. With fd -1 the bytes
+  are read and dropped. crc is set to the CRC32C of the bytes read*/
+off_t recv_range(int sock, int fd, off_t offset, off_t length, uint32_t *crc) {
+	char *buff;
+	off_t got = 0;
+	ssize_t n;
+
+	*crc = 0;
+	if ((buff = malloc(CHUNK)) == NULL) {
+		return -1;
+	}
+	while (got < length) {
+		n = read(sock, buff, (length - got) < CHUNK ? (length - got) : CHUNK);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		*crc = crc32c(*crc, buff, n);
+		if (fd >= 0 && pwrite_all(fd, buff, n, offset + got) != 0) {
+			perror("ERROR: write failed");
+			free(buff);
+			return -1;
+		}
+		got += n;
+	}
+	free(buff);
+	return got;
+}
+
+
+/*recv_multi stores framed files until the end frame, acking each one as soon as it is on disk.
+  A file that cannot be created is still read off the connection so the stream stays in step.
+  Returns the reply code for the whole stream; total is set to the bytes received*/
+int recv_multi(int sock, int flags, off_t *total) {
+	unsigned char len[2], size[8], ack[ACKSIZE];
+	char name[MAXNAME], path[sizeof(PREFIX) + MAXNAME];
+	uint32_t index, v, crc = 0;
+	off_t n, got;
+	int fd, code, first = CODE_OK;
+
+	*total = 0;
+	for (index = 0; ; index++) {
+		if (read_all(sock, len, 2) != 0) {
+			return CODE_MALFORMED;
+		}
+		n = (len[0] << 8) | len[1];
+		if (n == 0) {
+			break;
+		}
+		if (n > MAXNAME || read_all(sock, name, n) != 0 || read_all(sock, size, 8) != 0) {
+			return CODE_MALFORMED;
+		}
+		n = get_be64(size);
+		if (n < 0) {
+			return CODE_MALFORMED;
+		}
+		code = CODE_OK;
+		fd = -1;
+		if (output_name(name, (len[0] << 8) | len[1], path, sizeof(path)) != 0) {
+			code = CODE_MALFORMED;
+		} else if ((fd = open_output(path, n, 1)) < 0) {
+			code = CODE_CREATE;
+		}
+		if (flags & FLAG_COMPRESS) {
+			got = recv_blocks(sock, fd, 0, n, &crc);
+		} else {
+			got = recv_range(sock, fd, 0, n, &crc);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (got < 0) {
+			return CODE_GENERIC;
+		}
+		if (got < n) {
+			return CODE_MALFORMED;
+		}
+		if ((flags & FLAG_CRC) && code == CODE_OK) {
+			code = check_trailer(sock, crc);
+		} else if ((flags & FLAG_CRC) && read_all(sock, &v, 4) != 0) {
+			return CODE_MALFORMED;
+		}
+		if (code == CODE_MALFORMED) {
+			return code;
+		}
+		*total += got;
+		if (first == CODE_OK) {
+			first = code;
+		}
+
+		v = htonl(index);
+		memcpy(ack, &v, 4);
+		v = htonl(code);
+		memcpy(ack + 4, &v, 4);
+		put_be64(ack + 8, code == CODE_OK ? got : 0);
+		if (write_all(sock, ack, ACKSIZE) != 0) {
+			return CODE_GENERIC;
+		}
+	}
+	if (first != CODE_OK) {
+		return first;
+	}
+	return extra_bytes(sock) ? CODE_TOOMANY : CODE_OK;
+}
+
+
+/*recv_blocks reads compressed/raw blocks until length bytes have been restored and pwrites them
+  at offset. Returns the bytes stored, short if a block is malformed or does not inflate to its
+  announced length, or -1 if the file could not be written. With fd -1 the bytes are dropped.
+  crc is set to the CRC32C of the restored bytes*/
+off_t recv_blocks(int sock, int fd, off_t offset, off_t length, uint32_t *crc) {
+	unsigned char head[BLOCKHEADER], *in, *raw;
+	uint32_t rawlen, stored;
+	uLongf outlen;
+	off_t got = 0;
+
+	*crc = 0;
+	in = malloc(compressBound(BLOCKSIZE));
+	raw = malloc(BLOCKSIZE);
+	if (in == NULL || raw == NULL) {
+		free(in);
+		free(raw);
+		return -1;
+	}
+	while (got < length) {
+		if (read_all(sock, head, BLOCKHEADER) != 0) {
+			break;
+		}
+		memcpy(&rawlen, head + 1, 4);
+		memcpy(&stored, head + 5, 4);
+		rawlen = ntohl(rawlen);
+		stored = ntohl(stored);
+		if ((head[0] != 'Z' && head[0] != 'R') || rawlen == 0 || rawlen > BLOCKSIZE || rawlen > length - got || stored > compressBound(BLOCKSIZE) || (head[0] == 'R' && stored != rawlen)) {
+			break;
+		}
+		if (read_all(sock, head[0] == 'R' ? raw : in, stored) != 0) {
+			break;
+		}
+		if (head[0] == 'Z') {
+			outlen = rawlen;
+			if (uncompress(raw, &outlen, in, stored) != Z_OK || outlen != rawlen) {
+				break;
+			}
+		}
+		*crc = crc32c(*crc, raw, rawlen);
+		if (fd >= 0 && pwrite_all(fd, raw, rawlen, offset + got) != 0) {
+			perror("ERROR: write failed");
+			free(in);
+			free(raw);
+			return -1;
+		}
+		got += rawlen;
+	}
+	free(in);
+	free(raw);
+	return got;
+}
+
+
+/*recv_delta sends signatures of the current copy of path (none if there is no copy), then
+  applies the client's tokens to a new file next to it and renames it into place. shipped is
+  set to the token bytes read. Returns the reply code*/
+int recv_delta(int sock, const char *path, off_t size, int check, off_t *shipped) {
+	char part[4096];
+	unsigned char *old = NULL, tok[5];
+	char *buff = NULL;
+	uint32_t block = MINBLOCK, count = 0, v, crc = 0;
+	off_t oldsize = 0, written = 0, n, len;
+	struct stat st;
+	int oldfd, fd, code = CODE_MALFORMED;
+
+	*shipped = 0;
+	if ((oldfd = open(path, O_RDONLY)) >= 0 && fstat(oldfd, &st) == 0 && st.st_size > 0) {
+		oldsize = st.st_size;
+		old = mmap(NULL, oldsize, PROT_READ, MAP_PRIVATE, oldfd, 0);
+		if (old == MAP_FAILED) {
+			old = NULL;
+			oldsize = 0;
+		}
+	}
+	while ((off_t)block * block < oldsize && block < MAXBLOCK) {
+		block <<= 1;
+	}
+	count = (oldsize + block - 1) / block;
+	if (send_signatures(sock, old, oldsize, block) != 0) {
+		code = CODE_GENERIC;
+		goto out;
+	}
+
+	/*a unique name, so concurrent delta uploads of the same file never share a partial copy;
+	  the last one renamed wins*/
+	snprintf(part, sizeof(part), "%s%s", path, PARTSUFFIX);
+	if ((fd = mkstemp(part)) < 0) {
+		perror("ERROR: Cannot create file");
+		code = CODE_CREATE;
+		goto out;
+	}
+	fchmod(fd, 0644);
+	if (size > 0 && fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP) {
+		perror("ERROR: Cannot allocate file");
+		code = CODE_CREATE;
+		goto fail;
+	}
+	if ((buff = malloc(CHUNK)) == NULL) {
+		code = CODE_GENERIC;
+		goto fail;
+	}
+	while (1) {
+		if (read_all(sock, tok, 1) != 0) {
+			goto fail;
+		}
+		*shipped += 1;
+		if (tok[0] == 'E') {
+			break;
+		}
+		if ((tok[0] != 'L' && tok[0] != 'B') || read_all(sock, tok + 1, 4) != 0) {
+			goto fail;
+		}
+		*shipped += 4;
+		memcpy(&v, tok + 1, 4);
+		v = ntohl(v);
+		if (tok[0] == 'B') {
+			if (v >= count) {
+				goto fail;
+			}
+			len = (v == count - 1) ? oldsize - (off_t)v * block : block;
+			if (written + len > size) {
+				goto fail;
+			}
+			crc = crc32c(crc, old + (off_t)v * block, len);
+			if (write_all(fd, old + (off_t)v * block, len) != 0) {
+				code = CODE_GENERIC;
+				goto fail;
+			}
+			written += len;
+			continue;
+		}
+		if (written + (off_t)v > size) {
+			goto fail;
+		}
+		for (len = v; len > 0; len -= n) {
+			n = len < CHUNK ? len : CHUNK;
+			if (read_all(sock, buff, n) != 0) {
+				goto fail;
+			}
+			crc = crc32c(crc, buff, n);
+			if (write_all(fd, buff, n) != 0) {
+				code = CODE_GENERIC;
+				goto fail;
+			}
+			*shipped += n;
+		}
+		written += v;
+	}
+	if (written != size) {
+		goto fail;
+	}
+	/*a bad copy never replaces the old one*/
+	if (check && (code = check_trailer(sock, crc)) != CODE_OK) {
+		goto fail;
+	}
+	if (rename(part, path) != 0) {
+		perror("ERROR: Cannot replace file");
+		code = CODE_CREATE;
+		goto fail;
+	}
+	code = extra_bytes(sock) ? CODE_TOOMANY : CODE_OK;
+	close(fd);
+	goto out;
+
+fail:
+	close(fd);
+	unlink(part);
+out:
+	free(buff);
+	if (old != NULL) {
+		munmap(old, oldsize);
+	}
+	if (oldfd >= 0) {
+		close(oldfd);
+	}
+	return code;
+}
+
+
+/*send_signatures sends the signature header and one weak/strong pair per block, batched into
+  CHUNK-sized writes*/
+int send_signatures(int sock, const unsigned char *old, off_t oldsize, uint32_t block) {
+	unsigned char head[4 + 4 + 8], *buff;
+	uint32_t count = (oldsize + block - 1) / block, i, v;
+	size_t used = 0;
+	off_t len;
+
+	v = htonl(block);
+	memcpy(head, &v, 4);
+	v = htonl(count);
+	memcpy(head + 4, &v, 4);
+	put_be64(head + 8, oldsize);
+	if (write_all(sock, head, sizeof(head)) != 0) {
+		return -1;
+	}
+	if ((buff = malloc(CHUNK)) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		len = (i == count - 1) ? oldsize - (off_t)i * block : block;
+		v = htonl(weak_sum(old + (off_t)i * block, len));
+		memcpy(buff + used, &v, 4);
+		strong_sum(old + (off_t)i * block, len, buff + used + 4);
+		used += SIGSIZE;
+		if (used + SIGSIZE > CHUNK || i == count - 1) {
+			if (write_all(sock, buff, used) != 0) {
+				free(buff);
+				return -1;
+			}
+			used = 0;
+		}
+	}
+	free(buff);
+	return 0;
+}
+
+
+/*check_trailer reads the CRC32C trailer and compares it with crc; returns CODE_OK,
+  CODE_CHECKSUM on a mismatch or CODE_MALFORMED if there is no trailer*/
+int check_trailer(int sock, uint32_t crc) {
+	uint32_t sent;
+
+	if (read_all(sock, &sent, 4) != 0) {
+		return CODE_MALFORMED;
+	}
+	if (ntohl(sent) != crc) {
+		printf("ERROR: CRC32C mismatch: received %08x, computed %08x\n", ntohl(sent), crc);
+		return CODE_CHECKSUM;
+	}
+	return CODE_OK;
+}
+
+
+/*extra_bytes reports whether the client sent more than the header announced. The client waits
+  for the reply before closing, so anything beyond the data is already queued*/
+int extra_bytes(int sock) {
+	char c;
+
+	return recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+
+/*send_reply sends code, ' ', size with a 4-byte size for legacy clients and 8 bytes otherwise*/
+int send_reply(int sock, int code, off_t size, int extended) {
+	unsigned char reply[4 + 1 + 8];
+	uint32_t v;
+
+	v = htonl(code);
+	memcpy(reply, &v, 4);
+	reply[4] = ' ';
+	if (extended) {
+		put_be64(reply + 5, size);
+		return write_all(sock, reply, 4 + 1 + 8);
+	}
+	v = htonl(size);
+	memcpy(reply + 5, &v, 4);
+	return write_all(sock, reply, 4 + 1 + 4);
+}
+
+
+/*write_all writes all len bytes, retrying short writes; returns 0 on success*/
+int write_all(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/*pwrite_all writes all len bytes at offset; returns 0 on success*/
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, p, len, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+/*read_all reads exactly len bytes; returns 0 on success, -1 on error or early end of stream*/
+int read_all(int fd, void *buf, size_t len) {
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/*put_be64 and get_be64 store and load 64-bit values in network byte order*/
+void put_be64(unsigned char *p, uint64_t v) {
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+uint64_t get_be64(const unsigned char *p) {
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+
+/*weak_sum is the rsync rolling checksum: a = sum of bytes, b = sum of (len - i) * byte, each
+  mod 2^16, packed as a | b << 16. Must match ftpc*/
+uint32_t weak_sum(const unsigned char *p, size_t len) {
+	uint32_t a = 0, b = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		a += p[i];
+		b += (uint32_t)(len - i) * p[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+
+/*strong_sum is MurmurHash3 x64 128 with seed 0. Must match ftpc*/
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+void strong_sum(const unsigned char *p, size_t len, unsigned char out[16]) {
+	const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+	size_t i, rem, nblocks = len / 16;
+	const unsigned char *tail = p + nblocks * 16;
+
+	for (i = 0; i < nblocks; i++) {
+		memcpy(&k1, p + i * 16, 8);
+		memcpy(&k2, p + i * 16 + 8, 8);
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+	k1 = 0;
+	k2 = 0;
+	rem = len & 15;
+	for (i = rem; i > 8; i--) {
+		k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+	}
+	for (i = (rem > 8 ? 8 : rem); i > 0; i--) {
+		k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+	}
+	if (rem > 8) {
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+	}
+	if (rem > 0) {
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	memcpy(out, &h1, 8);
+	memcpy(out + 8, &h2, 8);
+}
+
+
+/*crc32c_init builds the fallback table and picks the SSE4.2 kernel when the CPU supports it.
+  Must match ftpc. Called once from main before any thread starts*/
+#ifdef HAVE_X86_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c = crc, v;
+
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	return c;
+}
+#endif
+
+void crc32c_init(void) {
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		}
+		crc32c_tab[i] = c;
+	}
+	crc32c_kernel = crc32c_table;
+#ifdef HAVE_X86_CRC
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_kernel = crc32c_sse42;
+	}
+#endif
+}
+
+
+/*crc32c continues a CRC32C: start with 0 and feed the data in order*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	return ~crc32c_kernel(~crc, buf, len);
+}
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+	while (len-- > 0) {
+		crc = crc32c_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
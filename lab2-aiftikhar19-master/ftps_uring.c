@@ -0,0 +1,711 @@
+/*
+  Filename: ftps_uring.c
+  Synopsis: Receiver for the file transfer protocol spoken by ftpc, built on io_uring.
+            One thread serves every connection: accepts, socket receives, file writes and
+            replies are all queued on a single ring, and each connection owns several buffers
+            so the receive into one overlaps the write of the others. The file is preallocated
+            with fallocate from the announced size and saved as recvd_<name>.
+            Two headers are accepted:
+              legacy:   u32 size, ' ', name[20], ' ', data
+              extended: u32 0xFFFFFFFF, ' ', name[20], ' ', u8 version, u8 flags, u16 streams,
+                        u64 file size, u64 range offset, u64 range length, data
+            Only plain ranges are taken (flags 0, so -n and files over 2 GB work); delta,
+            multi-file, compressed and checksummed uploads are answered with code 400 and
+            need ftps. The ring is driven with the raw io_uring syscalls, so no liburing.
+            run the program using ftps_uring <local-port>
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#define NAMELEN 20		/*file name field in the header*/
+#define PREFIX "recvd_"		/*prefix for saved files*/
+#define HEADER (4 + 1 + NAMELEN + 1)
+
+#define EXT_MARKER 0xFFFFFFFFu
+#define EXT_VERSION 1
+#define EXT_FIELDS (1 + 1 + 2 + 8 + 8 + 8)	/*extended header after the name field*/
+
+/*A connection has at most one receive and BUFS writes in flight, plus the one accept, so the
+  completion ring (twice RINGSIZE) can never overflow*/
+#define MAXCONNS 256		/*connections served at once*/
+#define BUFS 4			/*receive buffers per connection*/
+#define BUFSIZE (1 << 20)
+#define RINGSIZE 1024
+
+/*what a completion is for; the low byte of user_data, with the buffer and connection above it*/
+#define OP_ACCEPT 0
+#define OP_HEADER 1
+#define OP_RECV 2
+#define OP_WRITE 3
+#define OP_REPLY 4
+#define OP_DRAIN 5
+
+/*states of a connection*/
+#define CONN_FREE 0
+#define CONN_HEADER 1
+#define CONN_DATA 2
+#define CONN_REPLY 3
+
+/*return codes*/
+#define CODE_OK 0
+#define CODE_TOOMANY 100
+#define CODE_CREATE 300
+#define CODE_GENERIC 400
+#define CODE_MALFORMED 500
+
+/*the submission and completion rings shared with the kernel*/
+struct ring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned tail;		/*our copy of the submission tail, published by ring_enter*/
+};
+
+/*one receive buffer: filled by a receive, then written to the file at offset*/
+struct buffer {
+	char *data;
+	off_t offset;		/*file offset of data[0]*/
+	size_t len;		/*bytes received into it*/
+	size_t done;		/*bytes of those written so far*/
+	int busy;		/*owned by a receive or a write*/
+};
+
+/*one client connection*/
+struct conn {
+	int state;
+	int sock, fd;
+	int extended;
+	unsigned char head[HEADER + EXT_FIELDS];
+	size_t have, need;	/*header bytes read and wanted*/
+	char path[sizeof(PREFIX) + NAMELEN];
+	off_t size, offset, length;
+	off_t received;		/*data bytes received*/
+	off_t written;		/*data bytes written to the file*/
+	int recving;		/*a receive is in flight*/
+	int writes;		/*writes in flight*/
+	int eof;		/*the peer stopped sending before the range was complete*/
+	int failed;		/*a write failed*/
+	int drain;		/*after the reply, shut down sending and drop the rest of an unsupported upload*/
+	struct buffer bufs[BUFS];
+	unsigned char reply[4 + 1 + 8];
+};
+
+/*Function Declarations*/
+int ring_init(struct ring *r, unsigned entries);
+struct io_uring_sqe *ring_sqe(struct ring *r);
+int ring_enter(struct ring *r, unsigned wait);
+void queue_accept(int listener);
+void queue_header(int i);
+void start_recv(int i);
+void queue_write(int i, int b);
+void on_accept(int listener, int res);
+void on_header(int i, int res);
+void on_recv(int i, int b, int res);
+void on_write(int i, int b, int res);
+void check_done(int i);
+void finish(int i, int code);
+void on_reply(int i, int res);
+void on_drain(int i, int res);
+void queue_drain(int i);
+void release(int i);
+int output_name(const char *field, size_t len, char *out, size_t outlen);
+int open_output(const char *path, off_t size, int truncate);
+int extra_bytes(int sock);
+void put_be64(unsigned char *p, uint64_t v);
+uint64_t get_be64(const unsigned char *p);
+
+struct ring ring;
+struct conn conns[MAXCONNS];
+int active;			/*connections in use*/
+int accepting;			/*an accept is queued*/
+
+int main(int argc, char *argv[]) {
+
+	/*Variable declarations*/
+	int sock, one = 1;			/*listening socket, option value*/
+	struct sockaddr_in serv_addr;		/*address to listen on*/
+	struct io_uring_cqe *cqe;		/*completion being handled*/
+	unsigned head;				/*completion ring position*/
+	uint64_t data;				/*user_data of the completion*/
+	int res;
+
+	/*Error check input*/
+	if (argc != 2) {
+		printf("ERROR: Incorrect number of arguments.\n");
+		printf("Use the format: ftps_uring <local-port>\n");
+		exit(0);
+	}
+
+	if (ring_init(&ring, RINGSIZE) != 0) {
+		perror("ERROR: Cannot set up io_uring");
+		exit(1);
+	}
+
+	/*Initialize socket*/
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("ERROR: Cannot open socket");
+		exit(1);
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = INADDR_ANY;
+	serv_addr.sin_port = htons(atoi(argv[1]));
+	if (bind(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+		perror("ERROR: Cannot bind socket");
+		exit(1);
+	}
+	if (listen(sock, 64) < 0) {
+		perror("ERROR: Cannot listen");
+		exit(1);
+	}
+
+	/*print status*/
+	printf("Waiting for connections on port %s...\n", argv[1]);
+	fflush(stdout);
+
+	queue_accept(sock);
+	while (1) {
+		if (ring_enter(&ring, 1) != 0) {
+			perror("ERROR: io_uring_enter failed");
+			exit(1);
+		}
+		/*handlers may queue new work; it goes out with the next ring_enter*/
+		head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring.cqes[head & *ring.cq_mask];
+			data = cqe->user_data;
+			res = cqe->res;
+			head++;
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+			switch (data & 0xff) {
+			case OP_ACCEPT:
+				on_accept(sock, res);
+				break;
+			case OP_HEADER:
+				on_header(data >> 16, res);
+				break;
+			case OP_RECV:
+				on_recv(data >> 16, (data >> 8) & 0xff, res);
+				break;
+			case OP_WRITE:
+				on_write(data >> 16, (data >> 8) & 0xff, res);
+				break;
+			case OP_REPLY:
+				on_reply(data >> 16, res);
+				break;
+			case OP_DRAIN:
+				on_drain(data >> 16, res);
+				break;
+			}
+		}
+		if (!accepting && active < MAXCONNS) {
+			queue_accept(sock);
+		}
+	}
+
+return 0;
+}
+
+
+/*ring_init sets up an io_uring with entries submission slots and maps its rings*/
+int ring_init(struct ring *r, unsigned entries) {
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	size_t sqlen, cqlen;
+	unsigned i;
+
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		return -1;
+	}
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		sqlen = cqlen = (sqlen > cqlen ? sqlen : cqlen);
+	}
+	sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else if ((cq = mmap(NULL, cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		return -1;
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		return -1;
+	}
+	r->entries = p.sq_entries;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->tail = *r->sq_tail;
+	/*slot i always holds sqe i*/
+	for (i = 0; i < r->entries; i++) {
+		r->sq_array[i] = i;
+	}
+	return 0;
+}
+
+
+/*ring_sqe returns a cleared submission entry, first handing the queue to the kernel if it is full*/
+struct io_uring_sqe *ring_sqe(struct ring *r) {
+	struct io_uring_sqe *sqe;
+
+	if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries && ring_enter(r, 0) != 0) {
+		perror("ERROR: io_uring_enter failed");
+		exit(1);
+	}
+	sqe = &r->sqes[r->tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->tail++;
+	return sqe;
+}
+
+
+/*ring_enter publishes the queued entries, submits them and waits for at least wait completions*/
+int ring_enter(struct ring *r, unsigned wait) {
+	unsigned submit;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	while (syscall(__NR_io_uring_enter, r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+		submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	}
+	return 0;
+}
+
+
+/*queue_accept asks for the next connection on the listening socket*/
+void queue_accept(int listener) {
+	struct io_uring_sqe *sqe = ring_sqe(&ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listener;
+	sqe->user_data = OP_ACCEPT;
+	accepting = 1;
+}
+
+
+/*queue_header receives the rest of connection i's header*/
+void queue_header(int i) {
+	struct conn *c = &conns[i];
+	struct io_uring_sqe *sqe = ring_sqe(&ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->sock;
+	sqe->addr = (uintptr_t)(c->head + c->have);
+	sqe->len = c->need - c->have;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->user_data = ((uint64_t)i << 16) | OP_HEADER;
+}
+
+
+/*start_recv receives the next piece of the range into a free buffer. Receives on one socket
+  are issued one at a time so the data arrives in order; MSG_WAITALL fills the whole buffer,
+  which keeps the file writes large*/
+void start_recv(int i) {
+	struct conn *c = &conns[i];
+	struct io_uring_sqe *sqe;
+	off_t left = c->length - c->received;
+	int b;
+
+	if (c->recving || c->eof || c->failed || left == 0) {
+		return;
+	}
+	for (b = 0; b < BUFS && c->bufs[b].busy; b++) {
+	}
+	if (b == BUFS) {
+		return;
+	}
+	c->bufs[b].busy = 1;
+	c->bufs[b].offset = c->offset + c->received;
+	c->recving = 1;
+
+	sqe = ring_sqe(&ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->sock;
+	sqe->addr = (uintptr_t)c->bufs[b].data;
+	sqe->len = left < BUFSIZE ? left : BUFSIZE;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->user_data = ((uint64_t)i << 16) | (b << 8) | OP_RECV;
+}
+
+
+/*queue_write writes what is left of buffer b to the file at its offset*/
+void queue_write(int i, int b) {
+	struct conn *c = &conns[i];
+	struct buffer *buf = &c->bufs[b];
+	struct io_uring_sqe *sqe = ring_sqe(&ring);
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t)(buf->data + buf->done);
+	sqe->len = buf->len - buf->done;
+	sqe->off = buf->offset + buf->done;
+	sqe->user_data = ((uint64_t)i << 16) | (b << 8) | OP_WRITE;
+}
+
+
+/*on_accept sets up a connection slot for a new client and starts reading its header*/
+void on_accept(int listener, int res) {
+	struct conn *c;
+	int i, b;
+
+	accepting = 0;
+	if (res < 0) {
+		if (res != -EINTR && res != -ECONNABORTED) {
+			errno = -res;
+			perror("ERROR: accept failed");
+		}
+		return;
+	}
+	for (i = 0; conns[i].state != CONN_FREE; i++) {
+	}
+	c = &conns[i];
+	memset(c, 0, sizeof(*c));
+	for (b = 0; b < BUFS; b++) {
+		if (posix_memalign((void **)&c->bufs[b].data, 4096, BUFSIZE) != 0) {
+			printf("ERROR: Out of memory\n");
+			while (--b >= 0) {
+				free(c->bufs[b].data);
+			}
+			close(res);
+			return;
+		}
+	}
+	c->state = CONN_HEADER;
+	c->sock = res;
+	c->fd = -1;
+	c->need = HEADER;
+	active++;
+	queue_header(i);
+}
+
+
+/*on_header checks the header once all of it is in, opens the output file and starts the data*/
+void on_header(int i, int res) {
+	struct conn *c = &conns[i];
+	unsigned char *ext = c->head + HEADER;
+	uint32_t marker;
+
+	if (res <= 0) {
+		/*the client went away before sending a header; there is no one to answer*/
+		close(c->sock);
+		release(i);
+		return;
+	}
+	c->have += res;
+	if (c->have < c->need) {
+		queue_header(i);
+		return;
+	}
+	memcpy(&marker, c->head, 4);
+	marker = ntohl(marker);
+	if (marker == EXT_MARKER && !c->extended) {
+		c->extended = 1;
+		c->need += EXT_FIELDS;
+		queue_header(i);
+		return;
+	}
+	if (c->extended) {
+		c->size = get_be64(ext + 4);
+		c->offset = get_be64(ext + 12);
+		c->length = get_be64(ext + 20);
+		if (ext[0] != EXT_VERSION || c->size < 0 || c->offset < 0 || c->length < 0 || c->offset > c->size || c->length > c->size - c->offset) {
+			finish(i, CODE_MALFORMED);
+			return;
+		}
+		if (ext[1] != 0) {
+			printf("ERROR: flags 0x%02x are not supported here; use ftps\n", ext[1]);
+			/*-c and -k clients send everything before they read the reply, so take it all;
+			  -d and -p clients wait for signatures or acks and only stop at end of file*/
+			c->drain = 1;
+			finish(i, CODE_GENERIC);
+			return;
+		}
+	} else {
+		c->size = marker;
+		c->offset = 0;
+		c->length = c->size;
+	}
+	if (c->head[4] != ' ' || c->head[4 + 1 + NAMELEN] != ' ' || output_name((char *)c->head + 5, NAMELEN, c->path, sizeof(c->path)) != 0) {
+		finish(i, CODE_MALFORMED);
+		return;
+	}
+
+	/*print status*/
+	printf("Receiving %s: bytes [%lld, %lld) of %lld\n", c->path, (long long)c->offset, (long long)(c->offset + c->length), (long long)c->size);
+
+	/*a legacy upload replaces the file; ranges only fill in their part of it*/
+	if ((c->fd = open_output(c->path, c->size, !c->extended)) < 0) {
+		finish(i, CODE_CREATE);
+		return;
+	}
+	c->state = CONN_DATA;
+	if (c->length == 0) {
+		finish(i, extra_bytes(c->sock) ? CODE_TOOMANY : CODE_OK);
+		return;
+	}
+	start_recv(i);
+}
+
+
+/*on_recv hands a filled buffer to the file and starts the next receive*/
+void on_recv(int i, int b, int res) {
+	struct conn *c = &conns[i];
+
+	c->recving = 0;
+	if (res <= 0 || c->failed) {
+		/*after a failed write the rest is read only to be dropped*/
+		c->eof = (res <= 0);
+		c->bufs[b].busy = 0;
+	} else {
+		c->received += res;
+		c->bufs[b].len = res;
+		c->bufs[b].done = 0;
+		c->writes++;
+		queue_write(i, b);
+		/*a short receive means the peer closed early; the next one will see the end*/
+	}
+	start_recv(i);
+	check_done(i);
+}
+
+
+/*on_write frees the buffer once it is on its way to disk, or writes the rest after a short write*/
+void on_write(int i, int b, int res) {
+	struct conn *c = &conns[i];
+	struct buffer *buf = &c->bufs[b];
+
+	if (res <= 0) {
+		errno = res < 0 ? -res : EIO;
+		perror("ERROR: Cannot write file");
+		c->failed = 1;
+	} else {
+		buf->done += res;
+		c->written += res;
+		if (buf->done < buf->len) {
+			queue_write(i, b);
+			return;
+		}
+	}
+	buf->busy = 0;
+	c->writes--;
+	start_recv(i);
+	check_done(i);
+}
+
+
+/*check_done replies once nothing is in flight and no more data will be read*/
+void check_done(int i) {
+	struct conn *c = &conns[i];
+
+	if (c->recving || c->writes > 0) {
+		return;
+	}
+	if (c->failed) {
+		finish(i, CODE_GENERIC);
+	} else if (c->received < c->length) {
+		finish(i, CODE_MALFORMED);
+	} else {
+		finish(i, extra_bytes(c->sock) ? CODE_TOOMANY : CODE_OK);
+	}
+}
+
+
+/*finish closes the file and queues the reply: u32 code, ' ', then the bytes stored as u32 for
+  the legacy header or u64 for the extended one*/
+void finish(int i, int code) {
+	struct conn *c = &conns[i];
+	struct io_uring_sqe *sqe;
+	off_t got = c->failed ? 0 : c->written;
+	uint32_t v;
+
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+		printf("Received %s: %lld bytes, code %d\n", c->path, (long long)got, code);
+	}
+	v = htonl(code);
+	memcpy(c->reply, &v, 4);
+	c->reply[4] = ' ';
+	if (c->extended) {
+		put_be64(c->reply + 5, got);
+	} else {
+		v = htonl(got);
+		memcpy(c->reply + 5, &v, 4);
+	}
+	c->state = CONN_REPLY;
+
+	sqe = ring_sqe(&ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->sock;
+	sqe->addr = (uintptr_t)c->reply;
+	sqe->len = c->extended ? 4 + 1 + 8 : 4 + 1 + 4;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = ((uint64_t)i << 16) | OP_REPLY;
+}
+
+
+/*on_reply handles the reply being sent. A drained connection is shut down for writing, so a
+  client still waiting for signatures or acks sees the end of the stream and gives up, and is
+  then read until the client closes*/
+void on_reply(int i, int res) {
+	struct conn *c = &conns[i];
+
+	if (!c->drain || res <= 0) {
+		release(i);
+		return;
+	}
+	shutdown(c->sock, SHUT_WR);
+	queue_drain(i);
+}
+
+
+/*on_drain handles each read of a drained connection; it is released once the client closes*/
+void on_drain(int i, int res) {
+	if (res <= 0) {
+		release(i);
+		return;
+	}
+	queue_drain(i);
+}
+
+
+/*queue_drain reads and drops the next piece of a drained connection*/
+void queue_drain(int i) {
+	struct conn *c = &conns[i];
+	struct io_uring_sqe *sqe;
+
+	sqe = ring_sqe(&ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->sock;
+	sqe->addr = (uintptr_t)c->bufs[0].data;
+	sqe->len = BUFSIZE;
+	sqe->user_data = ((uint64_t)i << 16) | OP_DRAIN;
+}
+
+
+/*release closes connection i once its reply is sent and frees the slot*/
+void release(int i) {
+	struct conn *c = &conns[i];
+	int b;
+
+	if (c->state == CONN_REPLY) {
+		close(c->sock);
+	}
+	for (b = 0; b < BUFS; b++) {
+		free(c->bufs[b].data);
+	}
+	c->state = CONN_FREE;
+	active--;
+}
+
+
+/*output_name turns a name of up to len bytes into recvd_<basename>; returns -1 if no usable
+  name is left*/
+int output_name(const char *field, size_t len, char *out, size_t outlen) {
+	char name[NAMELEN + 1];
+	char *base;
+
+	if (len > NAMELEN) {
+		return -1;
+	}
+	memcpy(name, field, len);
+	name[len] = '\0';
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	if (base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+		return -1;
+	}
+	snprintf(out, outlen, "%s%s", PREFIX, base);
+	return 0;
+}
+
+
+/*open_output opens path for writing with its full size allocated up front, so the writes
+  never extend the file and the blocks are laid out in one go*/
+int open_output(const char *path, off_t size, int truncate) {
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644)) < 0) {
+		perror("ERROR: Cannot create file");
+		return -1;
+	}
+	if (size > 0 && fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP) {
+		perror("ERROR: Cannot allocate file");
+		close(fd);
+		return -1;
+	}
+	/*drop anything left over from a larger file of the same name*/
+	if (fstat(fd, &st) == 0 && st.st_size != size && ftruncate(fd, size) != 0) {
+		perror("ERROR: Cannot size file");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/*extra_bytes returns 1 if the client sent more than it announced*/
+int extra_bytes(int sock) {
+	char c;
+
+	return recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+
+/*put_be64 stores v big-endian*/
+void put_be64(unsigned char *p, uint64_t v) {
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/*get_be64 reads a big-endian 64-bit value*/
+uint64_t get_be64(const unsigned char *p) {
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
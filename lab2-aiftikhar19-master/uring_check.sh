@@ -0,0 +1,51 @@
+#!/bin/sh
+# Filename: uring_check.sh
+# Synopsis: checks that ftps_uring turns down the uploads it does not take (-d, -p, -c and -k)
+#           with an error instead of leaving ftpc waiting, and still stores a plain upload.
+#           run it using uring_check.sh [port]  (from the directory holding ftpc and ftps_uring)
+
+PORT=${1:-5470}
+WAIT=20		# seconds before a client counts as hung
+BIN=$(pwd)
+DIR=$(mktemp -d /tmp/uring_check.XXXXXX)
+FAILED=0
+
+cd "$DIR" || exit 1
+head -c 3000000 /dev/urandom > upload
+head -c 5000 /dev/urandom > second
+"$BIN/ftps_uring" "$PORT" > server.log 2>&1 &
+SERVER=$!
+sleep 1
+
+# each unsupported option must fail, and must fail before the timeout
+for opts in "-d" "-p" "-c 6" "-k"; do
+	if [ "$opts" = "-p" ]; then
+		files="upload second"
+	else
+		files="upload"
+	fi
+	timeout $WAIT "$BIN/ftpc" $opts 127.0.0.1 "$PORT" $files > client.log 2>&1
+	rc=$?
+	if [ $rc -eq 124 ]; then
+		echo "FAIL: ftpc $opts hung"
+		FAILED=1
+	elif [ $rc -eq 0 ]; then
+		echo "FAIL: ftpc $opts was accepted"
+		FAILED=1
+	else
+		echo "ok: ftpc $opts turned down (exit $rc)"
+	fi
+done
+
+# a plain upload still goes through
+if timeout $WAIT "$BIN/ftpc" 127.0.0.1 "$PORT" upload > client.log 2>&1 && cmp -s upload recvd_upload; then
+	echo "ok: plain upload stored"
+else
+	echo "FAIL: plain upload"
+	FAILED=1
+fi
+
+kill $SERVER
+wait $SERVER 2> /dev/null
+cd / && rm -rf "$DIR"
+exit $FAILED
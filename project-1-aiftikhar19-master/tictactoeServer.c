@@ -5,8 +5,11 @@
   Synopsis: This program is a UDP server side tictactoe game implementation. It allows for two players on different networks to play; this version automatically generates moves. Further, the server can send and recieve multicast requests from a client as well as resume a game provided a game board from a client.
 */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -18,64 +21,178 @@
 #include <ctype.h>
 #include <time.h>
 #include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 
 /*Global variables*/
 #define ROWS 3
 #define COLUMNS 3
-#define sendrecvflag 0
-#define bytes 15
-#define totalGames 3
-#define TIMEOUT 10
+/*square n (1-9) of a board is bit n-1 of each player's mask*/
+#define SQUARE(n) (1u << ((n) - 1))
+#define FULL_BOARD 0x1ff
+/*version 4 carries a 1-byte game number, version 5 a 32-bit session id; messages of both
+  versions are handled in the version 5 layout and converted back on the way out*/
+#define LEGACY_VERSION 4
+#define VERSION 5
+#define V4_BYTES 15
+#define V5_BYTES 18
+#define bytes V5_BYTES
+#define SESSION_OFFSET 5
+#define BOARD_OFFSET 9
+/*games held at once across all workers, set with -g; the hash table is kept at most half full*/
+#define DEFAULT_GAMES 65536
+#define MAX_GAMES (1 << 26)
+/*game socket and multicast socket*/
+#define MAXEVENTS 2
+/*datagrams read by one recvmmsg, and replies held for one sendmmsg; set with -b*/
+#define DEFAULT_BATCH 32
+#define MAX_BATCH 1024
+/*worker threads for -t; each shard needs some session ids below 256 for version 4 clients*/
+#define MAX_THREADS 64
+/*a session id carries its shard, so only the worker that owns it ever touches it*/
+#define GAME_NUMBER(seq) ((uint64_t)(seq) * nthreads + my_shard)
+#define GAME_SHARD(num) ((num) % nthreads)
+/*sequence numbers below this give ids under 256 and are kept for version 4 clients*/
+#define V4_SEQS ((256 + nthreads - 1) / nthreads)
 /*predefined multicast port and IP*/
 #define MC_PORT 1818
 #define MC_GROUP "239.0.0.1"
 
-/*Function Declarations*/
-int game_check(int sock, struct sockaddr_in serv_addr, struct sockaddr_in cli_addr, struct timeval tv);
-int setBoard(char msg[bytes], char board[ROWS][COLUMNS]);
-int play(char board[ROWS][COLUMNS], char msg[bytes], int sock, struct sockaddr_in serv_addr, struct sockaddr_in cli_addr, int game_num);
-void deleteGame(int game_num);
-int check_response(char board[ROWS][COLUMNS], char msg[bytes], int player, int i, int sock, struct sockaddr_in serv_addr);
-int checkwin(char board[ROWS][COLUMNS]);
-void print_board(char board[ROWS][COLUMNS]);
-int initSharedState(char board[ROWS][COLUMNS]);
-
-
+/*a board is one 9-bit mask of squares per player: x for the server, o for the client*/
+struct board {
+  uint16_t x;
+  uint16_t o;
+};
+/*win_table[mask] is 1 if mask holds three in a row; filled once by win_init*/
+unsigned char win_table[FULL_BOARD + 1];
 
-/*structure used to keep track of different games*/
+/*Function Declarations*/
+void *worker(void *arg);
+int game_check(int sock, struct sockaddr_in serv_addr, char msg[bytes], struct sockaddr_in cli_addr);
+void batch_init(void);
+int recv_batch(int sock);
+void queue_reply(int sock, char msg[bytes], struct sockaddr_in cli_addr);
+void flush_replies(void);
+void print_histograms(void);
+uint32_t get_session(char msg[bytes]);
+void set_session(char msg[bytes], uint32_t id);
+void decode_msg(char msg[bytes]);
+int encode_msg(char msg[bytes], char out[bytes]);
+void table_init(void);
+uint32_t game_hash(uint32_t id);
+struct store_games *find_game(uint32_t id);
+struct store_games *insert_game(uint32_t id);
+int new_session(int legacy, uint32_t *id);
+int setBoard(char msg[bytes], struct board *board);
+int play(struct board *board, char msg[bytes], int sock, struct sockaddr_in serv_addr, struct sockaddr_in cli_addr, struct store_games *game);
+void deleteGame(uint32_t game_num);
+int check_response(struct board *board, char msg[bytes], int player, int i, int sock, struct sockaddr_in serv_addr);
+void win_init(void);
+int checkwin(struct board *board);
+void print_board(struct board *board);
+int initSharedState(struct board *board);
+
+
+
+/*structure used to keep track of different games: 8 bytes, so a cache line holds 8 slots*/
 struct store_games {
-  int game_num;
-  char board[ROWS][COLUMNS];
-  int turn_num;
-  char prev_msg[bytes];
+  uint32_t game_num;               /*session id, also the hash key; EMPTY_SESSION marks a free slot*/
+  struct board board;
 };
-/*can change how many games can be held*/
-struct store_games games[totalGames];
+/*the one session id never handed out*/
+#define EMPTY_SESSION UINT32_MAX
+/*open addressing hash table of games, with linear probing; each worker has its own table*/
+__thread struct store_games *games;
+__thread uint32_t table_mask;
+__thread int table_bits;
+int total_games = DEFAULT_GAMES;
+__thread int max_games;             /*this worker's share of -g*/
+__thread uint64_t next_seq;         /*next sequence number for a version 5 session id*/
 
 /*variable used to keep track of total number of games played since server started up*/
-static int current_game_count = 0;
+static __thread int current_game_count = 0;
 
 /*multicast structure*/
 struct ip_mreq mreq;
 
+/*one datagram in a receive or reply batch*/
+struct datagram {
+  char msg[bytes];
+  struct sockaddr_in addr;
+};
+
+/*one worker thread and the shard of games it owns*/
+struct worker {
+  int shard;
+  int sock, mc_sock;               /*mc_sock is -1 except for worker 0*/
+  struct sockaddr_in serv_addr;
+  pthread_t thread;
+  /*how many datagrams each recvmmsg and sendmmsg call moved; printed on SIGUSR1*/
+  unsigned long recv_hist[MAX_BATCH + 1], send_hist[MAX_BATCH + 1];
+};
+int nthreads = 1;
+struct worker workers[MAX_THREADS];
+__thread struct worker *my_worker;
+__thread int my_shard;
+__thread unsigned int rand_seed;
+
+/*receive batch filled by recvmmsg, and replies waiting for sendmmsg; per worker*/
+int batch_size = DEFAULT_BATCH;
+__thread struct datagram *in_dgrams, *out_dgrams;
+__thread struct mmsghdr *in_hdrs, *out_hdrs;
+__thread struct iovec *in_iov, *out_iov;
+__thread int out_count = 0, out_sock = -1;
+
 
 
 /*MAIN*/
 int main(int argc, char * argv[]) {
+  int opt;
+
+  /*read options*/
+  while ((opt = getopt(argc, argv, "b:g:t:")) != -1) {
+    switch (opt) {
+    case 'g':
+      total_games = atoi(optarg);
+      if (total_games < 1 || total_games > MAX_GAMES) {
+        printf("ERROR: game capacity must be between 1 and %d\n", MAX_GAMES);
+        exit(1);
+      }
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      if (nthreads < 1 || nthreads > MAX_THREADS) {
+        printf("ERROR: thread count must be between 1 and %d\n", MAX_THREADS);
+        exit(1);
+      }
+      break;
+    case 'b':
+      batch_size = atoi(optarg);
+      if (batch_size < 1 || batch_size > MAX_BATCH) {
+        printf("ERROR: batch size must be between 1 and %d\n", MAX_BATCH);
+        exit(1);
+      }
+      break;
+    default:
+      printf("Use the format: tictactoeServer [-b batch_size] [-g games] [-t threads] <port_number> \n");
+      exit(1);
+    }
+  }
+
   /*Error check input*/
-  if (argc != 2) {
+  if (argc - optind != 1) {
     printf("ERROR: Incorrect number of arguments.\n");
-    printf("Use the format: tictactoeServer <port_number> \n");
+    printf("Use the format: tictactoeServer [-b batch_size] [-g games] [-t threads] <port_number> \n");
     exit(1);
   }
 
   /*variable declarations*/
-  int PORT = atoi(argv[1]);
-  int sock, rc, mc_sock;
-  struct sockaddr_in serv_addr, cli_addr;
-  struct timeval tv;
-  fd_set socketFDS;
-  int maxSD = 0; // highest socket descriptor we've seen 
+  int PORT = atoi(argv[optind]);
+  int sock, mc_sock, i, one = 1, sig;
+  struct sockaddr_in serv_addr;
+  sigset_t sigs;
 
   /*check if the port number is between 1 and 64000*/
   if (PORT < 1 || PORT > 64000) {
@@ -83,25 +200,34 @@ int main(int argc, char * argv[]) {
     exit(1);
   }
 
-  /*Initialize socket connection*/
-  if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-    perror("ERROR: Cannot open datagram socket\n");
-    exit(1);
-  }
-
   /*format server*/
   memset( & serv_addr, 0, sizeof(serv_addr));
-  memset( & cli_addr, 0, sizeof(cli_addr));
 
   /*Filling server information*/
   serv_addr.sin_family = AF_INET;
   serv_addr.sin_addr.s_addr = INADDR_ANY;
   serv_addr.sin_port = htons(PORT);
 
-  /*Bind the socket with the server address*/
-  if (bind(sock, (struct sockaddr * ) & serv_addr, sizeof(serv_addr)) < 0) {
-    perror("ERROR: bind failed\n");
-    exit(1);
+  /*one game socket per worker on the same port; the kernel spreads clients across them by address*/
+  for (i = 0; i < nthreads; i++) {
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+      perror("ERROR: Cannot open datagram socket\n");
+      exit(1);
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+      perror("ERROR: setsockopt failed\n");
+      exit(1);
+    }
+
+    /*Bind the socket with the server address*/
+    if (bind(sock, (struct sockaddr * ) & serv_addr, sizeof(serv_addr)) < 0) {
+      perror("ERROR: bind failed\n");
+      exit(1);
+    }
+    workers[i].shard = i;
+    workers[i].sock = sock;
+    workers[i].mc_sock = -1;
+    workers[i].serv_addr = serv_addr;
   }
   
   /*set up multicast socket*/
@@ -123,203 +249,242 @@ int main(int argc, char * argv[]) {
 
   mreq.imr_multiaddr.s_addr = inet_addr(MC_GROUP);
   mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-  if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, & mreq, sizeof(mreq)) < 0) {
+  if (setsockopt(workers[0].sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, & mreq, sizeof(mreq)) < 0) {
     perror("ERROR: setsockopt failed\n");
     exit(1);
   }
-  
-  printf("Connected. Awaiting game request...\n");
+  /*multicast requests are answered by worker 0 from its own shard*/
+  workers[0].mc_sock = mc_sock;
+  workers[0].serv_addr = serv_addr;
 
-  /*necessary to generate random number for move*/
-  srand(time(0));
+  /*the win table is shared read-only by all workers*/
+  win_init();
 
-  /*CONTINUALLY CHECK FOR INCOMING GAME REQUESTS*/
-  while (1) {
-    /*zero socket descriptors*/
-    FD_ZERO(&socketFDS);
-    /*add regular socket and multicast socket to list of socket descriptors*/
-    FD_SET(sock, &socketFDS);
-    FD_SET(mc_sock, &socketFDS);
-    /*figure out which socket is largest for select*/
-    maxSD = sock;
-    if(mc_sock > maxSD) {
-      maxSD = mc_sock;
-    }
-    
-    /*blocks until something arrives*/
-    rc = select(maxSD + 1, &socketFDS, NULL, NULL, NULL);	
-    
-    /*check which socket recieved something and send to game_check to read command code*/
-    if (FD_ISSET(sock, &socketFDS)) { 
-      rc = game_check(sock, serv_addr, cli_addr, tv);
-      if(rc == 0) { // client disconnected
-      	printf("Time out...No messages received\n");
-      } else if (rc == -1) {
-      	printf("Something went wrong. Exiting...\n");
-      	exit(1);
-      }                
-    } else if (FD_ISSET(mc_sock, &socketFDS)){
-      rc = game_check(mc_sock, serv_addr, cli_addr, tv);
-      if(rc == 0) { // client disconnected
-      	printf("Time out...No messages received\n");
-      } else if (rc == -1) {
-      	printf("Something went wrong. Exiting...\n");
-      	exit(1);
-      }    
+  /*SIGUSR1 is blocked in every worker and taken by this thread to print the batch histograms*/
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0) {
+      printf("ERROR: Cannot start worker thread\n");
+      exit(1);
     }
   }
+
+  printf("Connected. Awaiting game request...\n");
+
+  while (1) {
+    if (sigwait(&sigs, &sig) == 0)
+      print_histograms();
+  }
   return 0;
 }
 
 
-/*game_check reads from provided socket and determines path based on command code*/
-int game_check(int sock, struct sockaddr_in serv_addr, struct sockaddr_in cli_addr, struct timeval tv) {
-  /*variable declarations*/
-  char board[ROWS][COLUMNS];
-  char msg[bytes];
-  memset(msg, 0, bytes);
-  int n, i, addrlen = sizeof(cli_addr), rc;
-  int game_check = 0;
+/*worker runs one shard: its own game socket (and the multicast socket for worker 0), game
+  table, batches and random numbers, pinned to one core*/
+void *worker(void *arg) {
+  struct worker *me = arg;
+  int fd, n, d, rc;
+  int epfd, nfds, e;
+  struct epoll_event ev, events[MAXEVENTS];
+  cpu_set_t allowed, cpus;
+  int cpu, nth;
+
+  my_worker = me;
+  my_shard = me->shard;
+
+  /*pin shard i to the i-th CPU this process may run on (a cpuset or container need not start
+    at CPU 0), wrapping when there are more workers than CPUs*/
+  CPU_ZERO(&cpus);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+    nth = my_shard % CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed) && nth-- == 0)
+        break;
+    }
+    CPU_SET(cpu, &cpus);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  } else {
+    rc = errno;
+  }
+  if (rc != 0) {
+    /*not fatal: the worker still runs, just wherever the scheduler puts it*/
+    errno = rc;
+    perror("WARNING: Cannot pin worker thread to its core\n");
+  }
 
-  /*set timeout- NOT USED*/
-  tv.tv_sec = TIMEOUT;
-  tv.tv_usec = 0;
+  /*necessary to generate random number for move*/
+  rand_seed = time(0) ^ (my_shard * 2654435761u);
 
+  batch_init();
+  table_init();
 
-  /*loop used for timeout purposes*/
-  do {
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, & tv, sizeof(tv)))
-       perror("ERROR - setsocketopt");
+  /*edge-triggered epoll: each socket is reported once per burst of datagrams, so it is read until empty*/
+  if ((epfd = epoll_create1(0)) < 0) {
+    perror("ERROR: epoll_create1 failed\n");
+    exit(1);
+  }
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.fd = me->sock;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, me->sock, &ev) < 0) {
+    perror("ERROR: epoll_ctl failed\n");
+    exit(1);
+  }
+  ev.data.fd = me->mc_sock;
+  if (me->mc_sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, me->mc_sock, &ev) < 0) {
+    perror("ERROR: epoll_ctl failed\n");
+    exit(1);
+  }
 
-    rc = recvfrom(sock, msg, bytes, sendrecvflag, (struct sockaddr * ) & cli_addr, (socklen_t * ) & addrlen);
+  /*CONTINUALLY CHECK FOR INCOMING GAME REQUESTS*/
+  while (1) {
+    /*blocks until something arrives*/
+    nfds = epoll_wait(epfd, events, MAXEVENTS, -1);
+    if (nfds < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("ERROR: epoll_wait failed\n");
+      exit(1);
+    }
 
-    if (rc <= 0) {
-      printf("ERROR: haven't received anything. RC is %d\nError code %d: %s.\n\n", rc, errno, strerror(errno));
-      return 0;
-    } else {
-      printf("\nOk, got something...\n");
-      break;
+    /*read each ready socket a batch at a time until it is empty; every datagram in a batch goes
+      to game_check, then all the replies it queued go out together*/
+    for (e = 0; e < nfds; e++) {
+      fd = events[e].data.fd;
+      while (1) {
+        n = recv_batch(fd);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+        } else if (n < 0) {
+          /*drop this one and keep draining*/
+          printf("ERROR: haven't received anything. RC is %d\nError code %d: %s.\n\n", n, errno, strerror(errno));
+          continue;
+        }
+        for (d = 0; d < n; d++) {
+          if (in_hdrs[d].msg_len == 0) {
+            printf("ERROR: haven't received anything. RC is 0\n\n");
+            continue;
+          }
+          printf("\nOk, got something...\n");
+          rc = game_check(fd, me->serv_addr, in_dgrams[d].msg, in_dgrams[d].addr);
+          if (rc == -1) {
+            printf("Something went wrong. Exiting...\n");
+            exit(1);
+          }
+        }
+        flush_replies();
+      }
     }
-  }while (1);
+  }
+  return NULL;
+}
+
+
+/*game_check takes one datagram received on provided socket and determines path based on command code.
+  Replies are queued and sent when the whole batch has been handled*/
+int game_check(int sock, struct sockaddr_in serv_addr, char msg[bytes], struct sockaddr_in cli_addr) {
+  /*variable declarations*/
+  struct store_games *game;
+  uint32_t id;
+  int rc;
 
   /*check command code*/
   switch (msg[1] + 0) {
   case 0:
     /*if initial incoming message has 0 for command, first check if game exists*/
-    for (i = 0; i < current_game_count; i++) {
+    /*a session id from another shard is not in this table*/
+    id = get_session(msg);
+    game = (GAME_SHARD(id) == my_shard) ? find_game(id) : NULL;
+    if (game != NULL) {
       /*if game is found, get game_num and board, and play*/
-      if ((games[i].game_num) == (msg[5] + 0)) {
-        game_check = 1;
-        printf("Found the game: %d\n", games[i].game_num);
-        rc = play(games[i].board, msg, sock, serv_addr, cli_addr, games[i].game_num);
-        if (rc != 0) {
-          printf("Something went wrong. Exiting...\n");
-          exit(1);
-        }
-      }
-    }
-    /*if game_num is not found, then print error*/
-    if (game_check == 0) {
-      printf("Game %d not found. Something's gone wrong. Exiting...\n", msg[5] + 0);
-      msg[2] = 8;
-      n = sendto(sock, msg, bytes, sendrecvflag, (struct sockaddr * ) & cli_addr, addrlen);
-      if (n != bytes) {
-        printf("ERROR: wrong number bytes read\n");
+      printf("Found the game: %u\n", game->game_num);
+      rc = play(&game->board, msg, sock, serv_addr, cli_addr, game);
+      if (rc != 0) {
+        printf("Something went wrong. Exiting...\n");
         exit(1);
       }
+    } else {
+      /*if game_num is not found, then print error*/
+      printf("Game %u not found. Something's gone wrong. Exiting...\n", id);
+      msg[2] = 8;
+      queue_reply(sock, msg, cli_addr);
     }
     return 1;
   case 1:
     /*check if there is space for another game*/
-    if (current_game_count == (totalGames)) {
+    if (current_game_count == max_games || new_session(msg[0] != VERSION, &id) != 0) {
       printf("ERROR: Not enough space for a new game. Please wait and try again later...\n");
       msg[2] = 7;
-      n = sendto(sock, msg, bytes, sendrecvflag, (struct sockaddr * ) & cli_addr, addrlen);
-      if (n != bytes) {
-        printf("ERROR: wrong number bytes read\n");
-        exit(1);
-      }
+      queue_reply(sock, msg, cli_addr);
       return 1;
     }
 
     /*command code of 1 means new game has been requested*/
     printf("New game requested. Initializing...\n");
 
-    /*initialize game board*/
-    rc = initSharedState(board);
+    /*add the game to the table and initialize its board*/
+    game = insert_game(id);
+    rc = initSharedState(&game->board);
     if (rc != 0) {
       printf("Something went wrong. Exiting...\n");
       exit(1);
     }
 
     /*assign game number to client*/
-    printf("Game number will be %d\n", current_game_count);
+    printf("Game number will be %u\n", id);
  
     /*send board to play for move generation*/
-    rc = play(board, msg, sock, serv_addr, cli_addr, current_game_count);
+    rc = play(&game->board, msg, sock, serv_addr, cli_addr, game);
     if (rc != 0) {
       printf("Something went wrong. Exiting...\n");
       exit(1);
     }
-
-    /*copy game_num and board to games array*/
-    games[current_game_count].game_num = current_game_count;
-    memcpy(games[current_game_count++].board, board, sizeof(board));
     return 1;
   case 2:
     /*Resume game request from client*/
     /*client's move already on board; client also sent turn number of move it just made; server sends new game number*/
-    if (current_game_count == totalGames) {
+    if (current_game_count == max_games || new_session(msg[0] != VERSION, &id) != 0) {
       msg[2] = 7;
-      n = sendto(sock, msg, bytes, sendrecvflag, (struct sockaddr * ) & cli_addr, addrlen);
-      if (n != bytes) {
-        printf("ERROR: wrong number bytes read\n");
-        exit(1);
-      }
+      queue_reply(sock, msg, cli_addr);
     } else {
       printf("\nResume game requested...Setting up game\n");
-      printf("Msg rcvd: %d, %d, %d, %d, %d, %d\n", msg[0] + 0, msg[1] + 0, msg[2] + 0, msg[3] + 0, msg[4] + 0, msg[5] + 0);
-      printf("Board rcvd: %d, %d, %d, %d, %d, %d, %d, %d, %d\n", msg[6]+0, msg[7]+0, msg[8]+0, msg[9]+0, msg[10]+0, msg[11]+0, msg[12]+0, msg[13]+0, msg[14]+0);
+      printf("Msg rcvd: %d, %d, %d, %d, %d, %u\n", msg[0] + 0, msg[1] + 0, msg[2] + 0, msg[3] + 0, msg[4] + 0, get_session(msg));
+      printf("Board rcvd: %d, %d, %d, %d, %d, %d, %d, %d, %d\n", msg[BOARD_OFFSET]+0, msg[BOARD_OFFSET+1]+0, msg[BOARD_OFFSET+2]+0, msg[BOARD_OFFSET+3]+0, msg[BOARD_OFFSET+4]+0, msg[BOARD_OFFSET+5]+0, msg[BOARD_OFFSET+6]+0, msg[BOARD_OFFSET+7]+0, msg[BOARD_OFFSET+8]+0);
       
       /*assign game number to client*/
-      printf("Game number will be %d\n", current_game_count);
+      printf("Game number will be %u\n", id);
       
-      /*initialize a new baord and recreate given client message*/
-      rc = initSharedState(board);
+      /*add the game to the table and recreate the board from the client message*/
+      game = insert_game(id);
+      rc = initSharedState(&game->board);
       if (rc != 0) {
         printf("Something went wrong. Exiting...\n");
         exit(1);
       }
 
-      rc = setBoard(msg, board);
+      rc = setBoard(msg, &game->board);
       if (rc != 0) {
         printf("Something went wrong. Exiting...\n");
         exit(1);
       } 
       
       /*send board to play function to generate moves*/
-      rc = play(board, msg, sock, serv_addr, cli_addr, current_game_count);
+      rc = play(&game->board, msg, sock, serv_addr, cli_addr, game);
       if (rc != 0) {
         printf("Something went wrong. Exiting...\n");
         exit(1);
       }
-
-      /*copy game_num and board to games array*/
-      games[current_game_count].game_num = current_game_count;
-      memcpy(games[current_game_count++].board, board, sizeof(board));
     }
     return 1;
   case 3:
     /*new server request from client*/
-    printf("Received: %d, %d, %d, %d, %d, %d\n", msg[0] + 0, msg[1] + 0, msg[2] + 0, msg[3] + 0, msg[4] + 0, msg[5] + 0);
-    if (current_game_count != totalGames) {
+    printf("Received: %d, %d, %d, %d, %d, %u\n", msg[0] + 0, msg[1] + 0, msg[2] + 0, msg[3] + 0, msg[4] + 0, get_session(msg));
+    if (current_game_count != max_games) {
       printf("I have space! Sent response to multicast request.\n");
       msg[2] = 9;
-      n = sendto(sock, msg, bytes, sendrecvflag, (struct sockaddr * ) & cli_addr, addrlen);
-      if (n != bytes) {
-        printf("ERROR: wrong number bytes read\n");
-        exit(1);
-      }
+      queue_reply(sock, msg, cli_addr);
     } else {
       printf("Unfortunately, I can't accept a new game right now\n");
     }
@@ -332,27 +497,24 @@ int game_check(int sock, struct sockaddr_in serv_addr, struct sockaddr_in cli_ad
 
 
 /*setBoard used to recreate board in resume game request*/
-int setBoard(char msg[bytes], char board[ROWS][COLUMNS]) {
+int setBoard(char msg[bytes], struct board *board) {
   int i, mark, copy[10];
-  int row, column;
   
   for(i = 1; i < 10; i++) {
-    copy[i] = msg[i+5];
+    copy[i] = msg[i + BOARD_OFFSET - 1];
   }
   //printf("Copied array: %d, %d, %d, %d, %d, %d, %d, %d, %d\n", copy[1], copy[2], copy[3], copy[4], copy[5], copy[6], copy[7], copy[8], copy[9]);
   
   for(i = 1; i < 10; i++) {
     mark = copy[i];
-    row = (int)((i- 1) / ROWS);
-    column = (i - 1) % COLUMNS;
     if (mark == 0) {
       //nothing - no move has been made here
     } else if (mark == 1) {
       //1 means player 1 (server) move
-      board[row][column] = 'X';
+      board->x |= SQUARE(i);
     } else if (mark == 2) {
       //2 means player 2 (client) move
-      board[row][column] = 'O';
+      board->o |= SQUARE(i);
     } else {
       printf("That's not right; this board is not correct.\n");
       return -1;
@@ -365,14 +527,12 @@ int setBoard(char msg[bytes], char board[ROWS][COLUMNS]) {
 
 
 /*play used to generate game moves*/
-int play(char board[ROWS][COLUMNS], char msg[bytes], int sock, struct sockaddr_in serv_addr, struct sockaddr_in cli_addr, int game_num) {
+int play(struct board *board, char msg[bytes], int sock, struct sockaddr_in serv_addr, struct sockaddr_in cli_addr, struct store_games *game) {
   /*variable declarations*/
-  int i = 0, j = 0, n, choice, row, column, player = 0, count = 0, rc;
-  char mark;
-  socklen_t addrlen = sizeof(cli_addr);
+  int i = 0, j = 0, choice, player = 0, count = 0, rc;
 
   /*debug statements*/
-  printf("Received: %d, %d, %d, %d, %d, %d\n", msg[0]+0, msg[1]+0, msg[2]+0, msg[3]+0, msg[4]+0, msg[5]+0);
+  printf("Received: %d, %d, %d, %d, %d, %u\n", msg[0]+0, msg[1]+0, msg[2]+0, msg[3]+0, msg[4]+0, get_session(msg));
   
   /*check if client sent game winning move in resume game request*/
   i = checkwin(board);
@@ -402,7 +562,7 @@ int play(char board[ROWS][COLUMNS], char msg[bytes], int sock, struct sockaddr_i
 
     if (player == 1) {
       /*my turn*/
-      choice = (rand() % (9 - 1 + 1)) + 1;
+      choice = (rand_r(&rand_seed) % (9 - 1 + 1)) + 1;
     } else if (player == 2) {
       /*client's turn*/
       choice = msg[3] + 0;
@@ -418,23 +578,16 @@ int play(char board[ROWS][COLUMNS], char msg[bytes], int sock, struct sockaddr_i
       return 0;
     }
 
-    /*set mark to X for player 1, O for player 2*/
-    mark = (player == 1) ? 'X' : 'O';
-    
-    /*math to figure out what move*/
-    row = (int)((choice - 1) / ROWS);
-    column = (choice - 1) % COLUMNS;
-    if (board[row][column] == (choice + '0')) {
-      board[row][column] = mark;
-    } else {
-      /*regenerate if invalid move*/
-      while (board[row][column] != (choice + '0') || ((choice + '0') < 0 && (choice + '0') > 10)) {
-        choice = (rand() % (9 - 1 + 1)) + 1;
-        row = (int)((choice - 1) / ROWS);
-        column = (choice - 1) % COLUMNS;
-      }
-      board[row][column] = mark;
+    /*regenerate if invalid move*/
+    while (choice < 1 || choice > 9 || ((board->x | board->o) & SQUARE(choice))) {
+      choice = (rand_r(&rand_seed) % (9 - 1 + 1)) + 1;
     }
+
+    /*set mark to X for player 1, O for player 2*/
+    if (player == 1)
+      board->x |= SQUARE(choice);
+    else
+      board->o |= SQUARE(choice);
     
     /*check for win again*/
     i = checkwin(board);
@@ -448,18 +601,10 @@ int play(char board[ROWS][COLUMNS], char msg[bytes], int sock, struct sockaddr_i
       msg[3] = choice;
       if(msg[4] != 0) 
       	msg[4]++;
-      msg[5] = game_num;
-      
-      /*update games in struct for current plays*/
-      games[msg[5]+0].turn_num = msg[4]+0;
-      memcpy(games[msg[5]+0].prev_msg, msg, sizeof(*msg));
+      set_session(msg, game->game_num);
       
-      n = sendto(sock, msg, bytes, sendrecvflag, (struct sockaddr * ) & cli_addr, addrlen);
-      if (n != bytes) {
-        printf("ERROR: wrong number bytes read\n");
-        exit(1);
-      }
-      printf("Sent: %d, %d, %d, %d, %d, %d\n\n", msg[0]+0, msg[1]+0, msg[2]+0, msg[3]+0, msg[4]+0, msg[5]+0);
+      queue_reply(sock, msg, cli_addr);
+      printf("Sent: %d, %d, %d, %d, %d, %u\n\n", msg[0]+0, msg[1]+0, msg[2]+0, msg[3]+0, msg[4]+0, get_session(msg));
     }
  
     /*check win*/
@@ -476,29 +621,35 @@ int play(char board[ROWS][COLUMNS], char msg[bytes], int sock, struct sockaddr_i
 }
 
 
-/*used to delete completed games from games structure*/
-void deleteGame(int num){
-  int index = 0;
-  while (index < current_game_count) {
-  	if (num == games[index].game_num) break;
-  	++index;
-  }
-  if (index == current_game_count) return;
+/*used to delete completed games from games structure. Later entries of the probe run are
+  shifted back into the gap, so lookups never need tombstones*/
+void deleteGame(uint32_t num){
+  uint32_t i, j, k;
+
+  if (GAME_SHARD(num) != my_shard)
+    return;
+  i = game_hash(num);
+  while (games[i].game_num != EMPTY_SESSION && games[i].game_num != num)
+    i = (i + 1) & table_mask;
+  if (games[i].game_num == EMPTY_SESSION) return;
   
-  printf("Deleting game %d...\n", num);
-  if(index != current_game_count) {
-     games[index].turn_num = games[current_game_count - 1].turn_num;
-  	games[index].game_num = games[current_game_count - 1].game_num;
-  	memcpy(games[current_game_count - 1].board, games[index].board, sizeof(games[index].board));
-  	memcpy(games[current_game_count - 1].prev_msg, games[index].prev_msg, sizeof(games[index].prev_msg));
+  printf("Deleting game %u...\n", num);
+  games[i].game_num = EMPTY_SESSION;
+  for (j = (i + 1) & table_mask; games[j].game_num != EMPTY_SESSION; j = (j + 1) & table_mask) {
+    /*an entry can fill the gap unless its home slot lies cyclically in (i, j]*/
+    k = game_hash(games[j].game_num);
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      games[i] = games[j];
+      games[j].game_num = EMPTY_SESSION;
+      i = j;
+    }
   }
   --current_game_count;
 }
 
 
 /*check_response used to error check response codes*/
-int check_response(char board[ROWS][COLUMNS], char msg[bytes], int player, int i, int sock, struct sockaddr_in cli_addr) {
-  int n;
+int check_response(struct board *board, char msg[bytes], int player, int i, int sock, struct sockaddr_in cli_addr) {
   /*check response code from msg*/
   switch (msg[2] + 0) {
   case 1:
@@ -514,35 +665,27 @@ int check_response(char board[ROWS][COLUMNS], char msg[bytes], int player, int i
     if (i == 1) {
       system("clear");
       print_board(board);
-      printf("Game %d Over\n", msg[5]+0);
+      printf("Game %u Over\n", get_session(msg));
       printf("==>\aPlayer %d wins\n\n", player);
       if (player == 2) {
         msg[2] = 5;
-        n = sendto(sock, msg, bytes, sendrecvflag, (struct sockaddr * ) & cli_addr, sizeof(cli_addr));
-        if (n != bytes) {
-          printf("ERROR: wrong number bytes read\n");
-          exit(1);
-        }
+        queue_reply(sock, msg, cli_addr);
       }
     } else if (i == 0) {
       system("clear");
       print_board(board);
-      printf("Game %d Over\n", msg[5]+0);
+      printf("Game %u Over\n", get_session(msg));
       printf("==>\aGame draw\n\n");
       if (player == 2) {
         msg[2] = 5;
-        n = sendto(sock, msg, bytes, sendrecvflag, (struct sockaddr * ) & cli_addr, sizeof(cli_addr));
-        if (n != bytes) {
-          printf("ERROR: wrong number bytes read\n");
-          exit(1);
-        }
+        queue_reply(sock, msg, cli_addr);
       }
-      //deleteGame(msg[5]+0);
+      //deleteGame(get_session(msg));
     }
     return 0;
   case 5:
     printf("Game Over Acknowledged\n\n");
-    deleteGame(msg[5]+0);
+    deleteGame(get_session(msg));
     return 1;
   case 6:
     printf("ERROR: Incompatible Version Number\n");
@@ -559,36 +702,31 @@ int check_response(char board[ROWS][COLUMNS], char msg[bytes], int player, int i
 }
 
 
-/*checkwin used to determine whether game is won*/
-int checkwin(char board[ROWS][COLUMNS]) {
-  if (board[0][0] == board[0][1] && board[0][1] == board[0][2]) // row matches
-    return 1;
-
-  else if (board[1][0] == board[1][1] && board[1][1] == board[1][2]) // row matches
-    return 1;
-
-  else if (board[2][0] == board[2][1] && board[2][1] == board[2][2]) // row matches
-    return 1;
-
-  else if (board[0][0] == board[1][0] && board[1][0] == board[2][0]) // column
-    return 1;
-
-  else if (board[0][1] == board[1][1] && board[1][1] == board[2][1]) // column
-    return 1;
-
-  else if (board[0][2] == board[1][2] && board[1][2] == board[2][2]) // column
-    return 1;
+/*win_init fills win_table: a mask wins if it covers any row, column or diagonal*/
+void win_init(void) {
+  static const uint16_t lines[8] = {
+    0007, 0070, 0700,  // rows
+    0111, 0222, 0444,  // columns
+    0421, 0124         // diagonals
+  };
+  int mask, i;
+
+  for (mask = 0; mask <= FULL_BOARD; mask++) {
+    for (i = 0; i < 8; i++) {
+      if ((mask & lines[i]) == lines[i]) {
+        win_table[mask] = 1;
+        break;
+      }
+    }
+  }
+}
 
-  else if (board[0][0] == board[1][1] && board[1][1] == board[2][2]) // diagonal
-    return 1;
 
-  else if (board[2][0] == board[1][1] && board[1][1] == board[0][2]) // diagonal
+/*checkwin used to determine whether game is won*/
+int checkwin(struct board *board) {
+  if (win_table[board->x] || win_table[board->o])
     return 1;
-
-  else if (board[0][0] != '1' && board[0][1] != '2' && board[0][2] != '3' &&
-    board[1][0] != '4' && board[1][1] != '5' && board[1][2] != '6' &&
-    board[2][0] != '7' && board[2][1] != '8' && board[2][2] != '9')
-
+  else if ((board->x | board->o) == FULL_BOARD)
     return 0; // Return of 0 means game over
   else
     return -1; // return of -1 means keep playing
@@ -596,29 +734,268 @@ int checkwin(char board[ROWS][COLUMNS]) {
 
 
 /*print_board used to print current variation of game board*/
-void print_board(char board[ROWS][COLUMNS]) {
+void print_board(struct board *board) {
+  char cell[10];
+  int i;
+
+  for (i = 1; i <= 9; i++) {
+    if (board->x & SQUARE(i))
+      cell[i] = 'X';
+    else if (board->o & SQUARE(i))
+      cell[i] = 'O';
+    else
+      cell[i] = i + '0';
+  }
   printf("\n\tCurrent TicTacToe Game\n\n");
   printf("Player 1 (X)  -  Player 2 (O)\n\n");
   printf("     |     |     \n");
-  printf("  %c  |  %c  |  %c \n", board[0][0], board[0][1], board[0][2]);
+  printf("  %c  |  %c  |  %c \n", cell[1], cell[2], cell[3]);
   printf("_____|_____|_____\n");
   printf("     |     |     \n");
-  printf("  %c  |  %c  |  %c \n", board[1][0], board[1][1], board[1][2]);
+  printf("  %c  |  %c  |  %c \n", cell[4], cell[5], cell[6]);
   printf("_____|_____|_____\n");
   printf("     |     |     \n");
-  printf("  %c  |  %c  |  %c \n", board[2][0], board[2][1], board[2][2]);
+  printf("  %c  |  %c  |  %c \n", cell[7], cell[8], cell[9]);
   printf("     |     |     \n\n");
 }
 
 
 /*initSharedState used to set up board*/
-int initSharedState(char board[ROWS][COLUMNS]) {
+int initSharedState(struct board *board) {
   /* this just initializing the shared state aka the board */
-  int i, j, count = 1;
-  for (i = 0; i < 3; i++)
-    for (j = 0; j < 3; j++) {
-      board[i][j] = count + '0';
-      count++;
+  board->x = 0;
+  board->o = 0;
+  return 0;
+}
+
+
+/*batch_init allocates the receive and reply batches and points each message header at its datagram*/
+void batch_init(void) {
+  int i;
+
+  in_dgrams = calloc(batch_size, sizeof(struct datagram));
+  out_dgrams = calloc(batch_size, sizeof(struct datagram));
+  in_hdrs = calloc(batch_size, sizeof(struct mmsghdr));
+  out_hdrs = calloc(batch_size, sizeof(struct mmsghdr));
+  in_iov = calloc(batch_size, sizeof(struct iovec));
+  out_iov = calloc(batch_size, sizeof(struct iovec));
+  if (!in_dgrams || !out_dgrams || !in_hdrs || !out_hdrs || !in_iov || !out_iov) {
+    printf("ERROR: Out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < batch_size; i++) {
+    in_iov[i].iov_base = in_dgrams[i].msg;
+    in_iov[i].iov_len = bytes;
+    in_hdrs[i].msg_hdr.msg_iov = &in_iov[i];
+    in_hdrs[i].msg_hdr.msg_iovlen = 1;
+    in_hdrs[i].msg_hdr.msg_name = &in_dgrams[i].addr;
+    out_iov[i].iov_base = out_dgrams[i].msg;
+    out_iov[i].iov_len = bytes;
+    out_hdrs[i].msg_hdr.msg_iov = &out_iov[i];
+    out_hdrs[i].msg_hdr.msg_iovlen = 1;
+    out_hdrs[i].msg_hdr.msg_name = &out_dgrams[i].addr;
+    out_hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+}
+
+
+/*recv_batch reads up to batch_size datagrams from sock without blocking. Returns how many,
+  or -1 with errno set (EAGAIN once the socket is empty)*/
+int recv_batch(int sock) {
+  int i, n;
+
+  for (i = 0; i < batch_size; i++) {
+    in_hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+  do {
+    n = recvmmsg(sock, in_hdrs, batch_size, MSG_DONTWAIT, NULL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    return -1;
+  }
+
+  /*short datagrams read as if the rest of the message were zero*/
+  for (i = 0; i < n; i++) {
+    memset(in_dgrams[i].msg + in_hdrs[i].msg_len, 0, bytes - in_hdrs[i].msg_len);
+    decode_msg(in_dgrams[i].msg);
+  }
+  __atomic_fetch_add(&my_worker->recv_hist[n], 1, __ATOMIC_RELAXED);
+  return n;
+}
+
+
+/*queue_reply copies msg into the reply batch for cli_addr, sending the batch first if it is
+  full or was queued for another socket*/
+void queue_reply(int sock, char msg[bytes], struct sockaddr_in cli_addr) {
+  if (out_count == batch_size || (out_count > 0 && sock != out_sock))
+    flush_replies();
+
+  out_sock = sock;
+  out_iov[out_count].iov_len = encode_msg(msg, out_dgrams[out_count].msg);
+  out_dgrams[out_count].addr = cli_addr;
+  out_count++;
+}
+
+
+/*flush_replies sends every queued reply with as few sendmmsg calls as the kernel allows*/
+void flush_replies(void) {
+  int sent = 0, n;
+
+  while (sent < out_count) {
+    n = sendmmsg(out_sock, out_hdrs + sent, out_count - sent, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      printf("ERROR: wrong number bytes sent\n");
+      exit(1);
+    }
+    __atomic_fetch_add(&my_worker->send_hist[n], 1, __ATOMIC_RELAXED);
+    sent += n;
+  }
+  out_count = 0;
+}
+
+
+/*print_histograms prints how many datagrams each recvmmsg and sendmmsg call moved, over all workers*/
+void print_histograms(void) {
+  unsigned long recvs, sends;
+  int i, w;
+
+  printf("\nBatch size histogram (batch size %d, %d workers)\n", batch_size, nthreads);
+  printf("  size     recvmmsg     sendmmsg\n");
+  for (i = 1; i <= batch_size; i++) {
+    recvs = sends = 0;
+    for (w = 0; w < nthreads; w++) {
+      recvs += __atomic_load_n(&workers[w].recv_hist[i], __ATOMIC_RELAXED);
+      sends += __atomic_load_n(&workers[w].send_hist[i], __ATOMIC_RELAXED);
+    }
+    if (recvs || sends)
+      printf("  %4d %12lu %12lu\n", i, recvs, sends);
+  }
+  fflush(stdout);
+}
+
+
+/*get_session reads the big-endian session id of a message*/
+uint32_t get_session(char msg[bytes]) {
+  const unsigned char *p = (const unsigned char *)msg + SESSION_OFFSET;
+
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+/*set_session stores a session id in a message*/
+void set_session(char msg[bytes], uint32_t id) {
+  unsigned char *p = (unsigned char *)msg + SESSION_OFFSET;
+
+  p[0] = id >> 24;
+  p[1] = id >> 16;
+  p[2] = id >> 8;
+  p[3] = id;
+}
+
+
+/*decode_msg turns a received version 4 message into the version 5 layout: the game number
+  becomes the session id and the board moves up behind it*/
+void decode_msg(char msg[bytes]) {
+  unsigned char game;
+
+  if (msg[0] == VERSION)
+    return;
+  game = msg[SESSION_OFFSET];
+  memmove(msg + BOARD_OFFSET, msg + SESSION_OFFSET + 1, ROWS * COLUMNS);
+  set_session(msg, game);
+}
+
+
+/*encode_msg writes msg into out in the version it came in and returns its length; version 4
+  clients only ever get session ids below 256*/
+int encode_msg(char msg[bytes], char out[bytes]) {
+  memcpy(out, msg, SESSION_OFFSET);
+  if (msg[0] == VERSION) {
+    memcpy(out + SESSION_OFFSET, msg + SESSION_OFFSET, V5_BYTES - SESSION_OFFSET);
+    return V5_BYTES;
+  }
+  out[SESSION_OFFSET] = get_session(msg) & 0xff;
+  memcpy(out + SESSION_OFFSET + 1, msg + BOARD_OFFSET, ROWS * COLUMNS);
+  return V4_BYTES;
+}
+
+
+/*table_init preallocates this worker's hash table: its share of -g games in at least twice
+  as many slots, rounded up to a power of two*/
+void table_init(void) {
+  max_games = (total_games + nthreads - 1) / nthreads;
+  for (table_bits = 1; (1u << table_bits) < 2u * max_games; table_bits++)
+    ;
+  table_mask = (1u << table_bits) - 1;
+  games = malloc(((size_t)table_mask + 1) * sizeof(struct store_games));
+  if (games == NULL) {
+    printf("ERROR: Out of memory for %d games\n", max_games);
+    exit(1);
+  }
+  /*all bits set is EMPTY_SESSION in every slot*/
+  memset(games, 0xff, ((size_t)table_mask + 1) * sizeof(struct store_games));
+  next_seq = V4_SEQS;
+}
+
+
+/*game_hash maps a session id to its home slot (Fibonacci hashing)*/
+uint32_t game_hash(uint32_t id) {
+  return (uint32_t)(id * 2654435761u) >> (32 - table_bits);
+}
+
+
+/*find_game returns the game with session id, or NULL*/
+struct store_games *find_game(uint32_t id) {
+  uint32_t i;
+
+  /*a client sending the reserved id must not be handed a free slot*/
+  if (id == EMPTY_SESSION)
+    return NULL;
+  for (i = game_hash(id); games[i].game_num != EMPTY_SESSION; i = (i + 1) & table_mask) {
+    if (games[i].game_num == id)
+      return &games[i];
+  }
+  return NULL;
+}
+
+
+/*insert_game claims the first free slot of id's probe run; the caller has checked that the
+  table has room and that id is not in it*/
+struct store_games *insert_game(uint32_t id) {
+  uint32_t i;
+
+  for (i = game_hash(id); games[i].game_num != EMPTY_SESSION; i = (i + 1) & table_mask)
+    ;
+  memset(&games[i], 0, sizeof(games[i]));
+  games[i].game_num = id;
+  current_game_count++;
+  return &games[i];
+}
+
+
+/*new_session picks an unused session id in this worker's shard. Version 4 clients get one of
+  the few ids below 256; version 5 clients get the next id from a counter that starts above
+  them. Returns -1 if no id is free*/
+int new_session(int legacy, uint32_t *id) {
+  uint64_t seq;
+
+  if (legacy) {
+    for (seq = 0; seq < V4_SEQS && GAME_NUMBER(seq) < 256; seq++) {
+      if (find_game(GAME_NUMBER(seq)) == NULL) {
+        *id = GAME_NUMBER(seq);
+        return 0;
+      }
     }
+    return -1;
+  }
+
+  /*the table is never full here, so an unused id turns up*/
+  do {
+    if (GAME_NUMBER(next_seq) >= EMPTY_SESSION)
+      next_seq = V4_SEQS;
+    *id = GAME_NUMBER(next_seq++);
+  } while (find_game(*id) != NULL);
   return 0;
 }